@@ -4,10 +4,23 @@ struct buf {
   uint sector;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  struct buf *qnext; // disk queue
   uchar data[512];
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
 
+// A transfer on the disk queue (ide.c): a buf's sector for
+// iderw, or whole pages for swapstart.  Much smaller than a
+// buf, so that a process evicting or swapping in a page can
+// keep it on its stack.
+struct idereq {
+  uint dev;
+  uint sector;
+  int write;
+  int done;
+  uint nsect;               // sectors to move
+  uint ndone;               // sectors moved so far
+  char *data[SWAPCLUSTER];  // memory of each page's worth of sectors
+  struct idereq *qnext;     // disk queue
+};
@@ -195,6 +195,15 @@ consoleintr(int (*getc)(void))
     case C('P'):  // Process listing.
       procdump();
       break;
+    case C('V'):  // Memory statistics.
+      kmemdump();
+      slabdump();
+      swapdump();
+      zswapdump();
+      textdump();
+      sharedump();
+      ksmdump();
+      break;
     case C('U'):  // Kill line.
       while(input.e != input.w &&
             input.buf[(input.e-1) % INPUT_BUF] != '\n'){
@@ -1,13 +1,17 @@
 struct buf;
 struct context;
 struct file;
+struct idereq;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct rmap;
 struct spinlock;
 struct stat;
+struct swappolicy;
 struct superblock;
-struct freeswapnode;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -56,8 +60,9 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
-void			writepg(char*, uint);
-void 			readpg(char*, uint);
+void			swapstart(struct idereq*, char**, int, uint, int);
+void			swapwait(struct idereq*);
+uint			idesize(int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,14 +70,25 @@ extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
-extern pte_t* 	owner[];
 char*           kalloc(int);
+char*           kalloc_order(int);
+char*           kalloc_noevict(void);
+uint            kfreepages(void);
 void            kfree(char*,int,pte_t*);
+void            kfree_order(char*, int);
+void            kmemdump(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void			lockpage(char*);
+int				trylockpage(char*);
+void			unlockpage(char*);
 void			own(char*, pte_t*);
 void			disown(char*);
-extern struct spinlock ownerlock;
+struct rmap*	rmapalloc(void);
+void			rmapfree(struct rmap*);
+void			rmapadd(char*, pte_t*, struct rmap*);
+void			rmapdel(char*, pte_t*);
+int				krefs(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -82,6 +98,7 @@ int             cpunum(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(uchar, int);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
@@ -91,6 +108,14 @@ void            log_write(struct buf*);
 void            begin_trans();
 void            commit_trans();
 
+// ksm.c
+void            ksmd(void);
+void            ksmdump(void);
+
+// lz.c
+int             lzcompress(uchar*, int, uchar*, int);
+int             lzdecompress(uchar*, int, uchar*, int);
+
 // mp.c
 extern int      ismp;
 int             mpbcpu(void);
@@ -102,6 +127,7 @@ void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -120,21 +146,38 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void(*)(void));
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabdump(void);
+
+// policy.c
+struct swappolicy*	policyinit(char*);
+
 // swap.c
-void			segflthandler(int);
+int				segflthandler(uint);
+void			swaptick(void);
+void			swapuncache(char*);
+void			kswapd(void);
+void			kswapdwake(void);
 void			swapinit(void);
 void			scnodeenqueue(void*);
 void			scnoderemove(void*);
-struct freeswapnode*	freeswapalloc(void);
+void			scnodecold(void*);
+int				swapalloc(int, int*);
 void			freeswapfree(uint);
+void			freeswapdup(uint);
+void			swapdump(void);
 char*			choosepageforeviction(void);
 uint			evict(char*);
 char*			swappage(void);
-int 			unswappage(pte_t*);
+int 			unswappage(pte_t*, int);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -159,12 +202,31 @@ char*           strncpy(char*, const char*, int);
 
 // syscall.c
 int             argint(int, int*);
-int             argptr(int, char**, int);
+int             argptr(int, char**, int, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
 
+// share.c
+void            shareinit(void);
+char*           sharelookup(struct inode*, uint);
+int             shareadd(struct inode*, uint, char*);
+int             shareevict(char*);
+int             shareclean(char*);
+void            sharewrite(struct inode*, uint, char*, char*, uint);
+void            shareinval(struct inode*);
+void            sharedump(void);
+
+// text.c
+void            textinit(void);
+char*           textlookup(struct inode*, uint, uint);
+void            textadd(struct inode*, uint, uint, char*, char**);
+int             textevict(char*);
+int             textpage(char*);
+void            textinval(struct inode*);
+void            textdump(void);
+
 // timer.c
 void            timerinit(void);
 
@@ -188,15 +250,53 @@ void            vmenable(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
+int             zeropage(pde_t*, uint, int, int);
 int             deallocuvm(pde_t*, uint, uint);
-void            freevm(pde_t*);
+void            freevm(pde_t*, struct vma*, int);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+int             loadpage(struct proc*, uint, int);
+int             populate(struct proc*, uint, uint, int);
+void            unpopulate(struct proc*);
+int             prefault(struct proc*, uint, uint);
+pde_t*          copyuvm(pde_t*, struct vma*, int);
+int             cowpage(pte_t*);
+void            coldpage(pde_t*, uint);
+int             madvise(struct proc*, uint, uint, int);
+void            mmapflush(void);
+int             mmap(struct vma*, uint);
+int             munmap(uint, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            tlbflush(pde_t*, uint);
+void            tlbflushrange(pde_t*, uint, uint);
+void            tlbflushall(pde_t*);
+void            tlbflushpte(pte_t*);
+void            tlbshootdown(void);
+void            tlbpoll(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+extern char     zeropg[];
+
+// vma.c
+struct vma*     vmafind(struct vma*, int, uint);
+int             vmaadd(struct vma*, int*, struct vma*);
+int             vmafill(struct vma*, int*, uint, uint, int);
+int             vmasplit(struct vma*, int*, uint);
+int             vmafree(struct vma*, int, uint, uint);
+int             vmacovers(struct vma*, int, uint, uint, int);
+uint            vmahole(struct vma*, int, uint, uint, uint);
+void            vmaremove(struct vma*, int*, uint, uint);
+void            vmadup(struct vma*, int);
+void            vmaput(struct vma*, int);
+
+// zswap.c
+void            zswapinit(uint);
+int             zswapstore(uint, char*);
+int             zswapload(uint, char*);
+int             zswaphas(uint);
+void            zswapdrop(uint);
+int             zswapevict(char*);
+void            zswapdump(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
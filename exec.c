@@ -6,22 +6,26 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "fs.h"
+#include "file.h"
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA], v;
   pde_t *pgdir, *oldpgdir;
 
   if((ip = namei(path)) == 0)
     return -1;
   ilock(ip);
   pgdir = 0;
+  nvma = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
@@ -32,7 +36,9 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program segments as areas backed by ip.
+  // Their pages are read in on first touch (see loadpage
+  // in vm.c).
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -41,29 +47,53 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr + ph.memsz < ph.vaddr ||
+       ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
+    if(ph.memsz == 0)
+      continue;
+    memset(&v, 0, sizeof(v));
+    v.start = ph.vaddr;
+    v.end = PGROUNDUP(ph.vaddr + ph.memsz);
+    v.type = VMA_FILE;
+    v.prot = (ph.flags & ELF_PROG_FLAG_WRITE) ? PTE_W : 0;
+    v.ip = ip;
+    v.off = ph.off;
+    v.filesz = ph.filesz;
+    if(vmaadd(vma, &nvma, &v) < 0)
+      goto bad;
+    idup(ip);
+    if(v.end > sz)
+      sz = v.end;
   }
-  iunlockput(ip);
-  ip = 0;
+  // Zero fill any gaps between the segments.
+  if(vmafill(vma, &nvma, 0, sz, PTE_W) < 0)
+    goto bad;
+  iunlock(ip);
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible.  Use the second as the user stack.
-  sz = PGROUNDUP(sz);
+  memset(&v, 0, sizeof(v));
+  v.start = sz;
+  v.end = sz + 2*PGSIZE;
+  v.type = VMA_STACK;
+  v.prot = PTE_W;
+  if(vmaadd(vma, &nvma, &v) < 0)
+    goto unlocked;
   if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE)) == 0)
-    goto bad;
+    goto unlocked;
   clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
 
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
-      goto bad;
+      goto unlocked;
     sp = (sp - (strlen(argv[argc]) + 1)) & ~3;
     if(copyout(pgdir, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+      goto unlocked;
     ustack[3+argc] = sp;
   }
   ustack[3+argc] = 0;
@@ -74,7 +104,7 @@ exec(char *path, char **argv)
 
   sp -= (3+argc+1) * 4;
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
-    goto bad;
+    goto unlocked;
 
   // Save program name for debugging.
   for(last=s=path; *s; s++)
@@ -83,19 +113,30 @@ exec(char *path, char **argv)
   safestrcpy(proc->name, last, sizeof(proc->name));
 
   // Commit to the user image.
+  mmapflush();
   oldpgdir = proc->pgdir;
   proc->pgdir = pgdir;
   proc->sz = sz;
   proc->tf->eip = elf.entry;  // main
   proc->tf->esp = sp;
   switchuvm(proc);
-  freevm(oldpgdir);
+  freevm(oldpgdir, proc->vma, proc->nvma);
+  vmaput(proc->vma, proc->nvma);
+  memmove(proc->vma, vma, sizeof(vma));
+  proc->nvma = nvma;
+  begin_trans();
+  iput(ip);
+  commit_trans();
   return 0;
 
  bad:
+  iunlock(ip);
+ unlocked:
   if(pgdir)
-    freevm(pgdir);
-  if(ip)
-    iunlockput(ip);
+    freevm(pgdir, vma, nvma);
+  vmaput(vma, nvma);
+  begin_trans();
+  iput(ip);
+  commit_trans();
   return -1;
 }
@@ -19,6 +19,7 @@
 #include "buf.h"
 #include "fs.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -158,13 +159,15 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache cache;
+  struct inode *inodes;        // Inodes with ref > 0
 } icache;
 
 void
 iinit(void)
 {
   initlock(&icache.lock, "icache");
+  kmem_cache_init(&icache.cache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -222,31 +225,39 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *new;
 
+  new = 0;
   acquire(&icache.lock);
-
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
+  for(;;){
+    // Is the inode already cached?
+    for(ip = icache.inodes; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&icache.lock);
+        if(new)
+          kmem_cache_free(&icache.cache, new);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    if(new)
+      break;
+    // Allocate outside the lock, then look again in case
+    // someone else brought the inode in meanwhile.
+    release(&icache.lock);
+    if((new = kmem_cache_alloc(&icache.cache)) == 0)
+      panic("iget: no inodes");
+    acquire(&icache.lock);
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = new;
+  memset(ip, 0, sizeof(*ip));
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->next = icache.inodes;
+  icache.inodes = ip;
   release(&icache.lock);
 
   return ip;
@@ -310,13 +321,15 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquire(&icache.lock);
   if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
     // inode has no links: truncate and free inode.
@@ -331,8 +344,15 @@ iput(struct inode *ip)
     ip->flags = 0;
     wakeup(ip);
   }
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&icache.lock);
+    return;
+  }
+  for(pp = &icache.inodes; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
   release(&icache.lock);
+  kmem_cache_free(&icache.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -395,6 +415,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  textinval(ip);
+  shareinval(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -475,11 +497,13 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  textinval(ip);  // running programs keep their copies
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
+    sharewrite(ip, off, (char*)bp->data + off%BSIZE, src, m);
     log_write(bp);
     brelse(bp);
   }
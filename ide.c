@@ -14,10 +14,12 @@
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
 #define IDE_DF        0x20
+#define IDE_DRQ       0x08
 #define IDE_ERR       0x01
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_IDENTIFY 0xec
 
 #define IDE_PORT_DATA     0x00
 #define IDE_PORT_FEATURE  0x01
@@ -28,15 +30,15 @@
 #define IDE_PORT_DRIVE    0x06
 #define IDE_PORT_COMMAND  0x07
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// idequeue points to the request now being read/written to the disk.
+// idequeue->qnext points to the next request to be processed.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct idereq *idequeue;
 
 static int present[4];
-static void idestart(struct buf*);
+static void idestart(struct idereq*);
 
 static int getbaseport(int dev) {
   return (dev == 1 || dev == 0)? 0x1f0: 0x170;
@@ -100,62 +102,163 @@ ideinit(void)
   selectdevice(0);
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Number of sectors on dev, from IDENTIFY DEVICE.
+// Polls the disk, so only for use at boot.
+uint
+idesize(int dev)
+{
+  ushort id[256];
+  int baseaddr, r;
+
+  if(!present[dev])
+    return 0;
+  baseaddr = getbaseport(dev);
+  acquire(&idelock);
+  idewait(0, dev);
+  outb(baseaddr + IDE_PORT_COMMAND, IDE_CMD_IDENTIFY);
+  while((r = inb(baseaddr + IDE_PORT_COMMAND)) & IDE_BSY)
+    ;
+  if((r & (IDE_ERR|IDE_DRQ)) != IDE_DRQ){
+    release(&idelock);
+    return 0;
+  }
+  insl(baseaddr + IDE_PORT_DATA, id, 512/4);
+  release(&idelock);
+  return id[60] | (id[61] << 16);  // LBA28 sector count
+}
+
+// Start request r.  Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(struct idereq *r)
 {
   int baseaddr, status;
-  if(b == 0)
+  if(r == 0)
     panic("idestart");
-  baseaddr = getbaseport(b->dev);
-  status = getstatusport(b->dev);
+  baseaddr = getbaseport(r->dev);
+  status = getstatusport(r->dev);
 
-  idewait(0, b->dev);
+  idewait(0, r->dev);
   outb(status, 0);  // generate interrupt 
-  outb(baseaddr + IDE_PORT_SECTORS, 1);  // number of sectors
-  outb(baseaddr + IDE_PORT_LBALOW, b->sector & 0xff);
-  outb(baseaddr + IDE_PORT_LBAMID, (b->sector >> 8) & 0xff);
-  outb(baseaddr + IDE_PORT_LBAHI, (b->sector >> 16) & 0xff);
-  outb(baseaddr + IDE_PORT_DRIVE, 0xe0 | ((b->dev&1)<<4) | ((b->sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  outb(baseaddr + IDE_PORT_SECTORS, r->nsect);  // number of sectors
+  outb(baseaddr + IDE_PORT_LBALOW, r->sector & 0xff);
+  outb(baseaddr + IDE_PORT_LBAMID, (r->sector >> 8) & 0xff);
+  outb(baseaddr + IDE_PORT_LBAHI, (r->sector >> 16) & 0xff);
+  outb(baseaddr + IDE_PORT_DRIVE, 0xe0 | ((r->dev&1)<<4) | ((r->sector>>24)&0x0f));
+  r->ndone = 0;
+  if(r->write){
     outb(baseaddr + IDE_PORT_COMMAND, IDE_CMD_WRITE);
-    outsl(baseaddr + IDE_PORT_DATA, b->data, 512/4);
+    outsl(baseaddr + IDE_PORT_DATA, r->data[0], 512/4);
+    r->ndone = 1;
   } else {
     outb(baseaddr + IDE_PORT_COMMAND, IDE_CMD_READ);
   }
 }
 
-// Interrupt handler.
-void
-ideintr(void)
+// Move the active request along as far as the disk allows.
+// The disk interrupts once per sector, so a swap transfer
+// takes several steps: a read collects each sector as it
+// arrives and a write hands over the next one when asked.
+// Looks at the status register rather than trusting the
+// interrupt, so a stray or late interrupt does no harm and
+// callers that can't sleep may poll with it.
+// Caller must hold idelock.
+static void
+idestep(void)
 {
-  struct buf *b;
+  struct idereq *q;
+  int r, baseaddr;
+  char *data;
 
-  // First queued buffer is the active request.
-  acquire(&idelock);
-  if((b = idequeue) == 0){
-    release(&idelock);
-    // cprintf("spurious IDE interrupt\n");
+  // First queued request is the active one.
+  if((q = idequeue) == 0)
     return;
+  baseaddr = getbaseport(q->dev);
+  r = inb(baseaddr + IDE_PORT_COMMAND);
+  if(r & IDE_BSY)
+    return;
+  if((r & (IDE_DF|IDE_ERR)) == 0){
+    data = q->data[q->ndone/(PGSIZE/512)] + (q->ndone%(PGSIZE/512))*512;
+    if(!q->write){
+      // Read data if needed.
+      if(!(r & IDE_DRQ))
+        return;
+      insl(baseaddr + IDE_PORT_DATA, data, 512/4);
+      q->ndone++;
+    } else if((r & IDE_DRQ) && q->ndone < q->nsect){
+      outsl(baseaddr + IDE_PORT_DATA, data, 512/4);
+      q->ndone++;
+      return;
+    }
+    if(q->ndone < q->nsect)
+      return;
   }
-  idequeue = b->qnext;
+  idequeue = q->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1,b->dev) >= 0)
-    insl(getbaseport(b->dev) + IDE_PORT_DATA, b->data, 512/4);
+  // Wake process waiting for this request.
+  q->done = 1;
+  wakeup(q);
   
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
-  
-  // Start disk on next buf in queue.
+  // Start disk on next request in queue.
   if(idequeue != 0)
     idestart(idequeue);
+}
 
+// Interrupt handler.
+void
+ideintr(void)
+{
+  acquire(&idelock);
+  idestep();
   release(&idelock);
 }
 
+// Append r to idequeue, starting the disk if it is idle.
+// Caller must hold idelock.
+static void
+idequeueadd(struct idereq *r)
+{
+  struct idereq **pp;
+
+  r->done = 0;
+  r->qnext = 0;
+  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+    ;
+  *pp = r;
+  
+  // Start disk if necessary.
+  if(idequeue == r)
+    idestart(r);
+}
+
+// Can the caller sleep until its request finishes?
+// Not outside a process or while holding a spinlock,
+// e.g. evicting a page for a kalloc done under a lock.
+static int
+cansleep(void)
+{
+  int r;
+
+  pushcli();
+  r = proc != 0 && cpu->ncli == 1;
+  popcli();
+  return r;
+}
+
+// Wait for request to finish, polling the disk if we
+// can't sleep.  Caller must hold idelock.
+static void
+idefinish(struct idereq *r, int sleepok)
+{
+  while(!r->done){
+    if(sleepok)
+      sleep(r, &idelock);
+    else {
+      idestep();
+      tlbpoll();
+    }
+  }
+}
+
 //PAGEBREAK!
 // Sync buf with disk. 
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
@@ -163,7 +266,7 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  struct idereq r;
 
   if(!(b->flags & B_BUSY))
     panic("iderw: buf not busy");
@@ -172,59 +275,59 @@ iderw(struct buf *b)
   if(!present[b->dev])
     panic("iderw: ide disk not present");
 
+  r.dev = b->dev;
+  r.sector = b->sector;
+  r.write = (b->flags & B_DIRTY) != 0;
+  r.nsect = 1;
+  r.data[0] = (char*)b->data;
   acquire(&idelock);  //DOC:acquire-lock
+  idequeueadd(&r);
+  idefinish(&r, 1);
+  release(&idelock);
+  b->flags |= B_VALID;
+  b->flags &= ~B_DIRTY;
+}
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-  
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
-  
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
-  }
+/*
+	Swap I/O goes through idequeue like any other request,
+	moving n pages to or from consecutive slots in one
+	transfer. swapstart only queues it, so the
+	caller can fix the order of requests for a slot while
+	holding swapiolock and wait for the disk after letting
+	go of it. The disk serves idequeue in order, so a read
+	queued after a write to the same slot sees the new data.
+	r must stay around until swapwait returns.
+*/
+void
+swapstart(struct idereq *r, char **pgs, int n, uint sector, int write)
+{
+  int i;
 
+  if(!present[SWAPDEV])
+    panic("swapstart: swap disk not present");
+  if(n < 1 || n > SWAPCLUSTER)
+    panic("swapstart: bad page count");
+  r->dev = SWAPDEV;
+  r->sector = sector;
+  r->write = write;
+  r->nsect = n * (PGSIZE/512);
+  for(i = 0; i < n; i++)
+    r->data[i] = pgs[i];
+  acquire(&idelock);
+  idequeueadd(r);
   release(&idelock);
 }
 
-// Write whole page without interrupts.
-void writepg(char* src, uint block) {
-	acquire(&idelock);
-  //cprintf("Starting swap write src %p block %d\n", src, block);
-  int status = getstatusport(SWAPDEV);
-  int baseaddr = getbaseport(SWAPDEV);
-  idewait(0,SWAPDEV);
-  outb(status, 1);  // don't generate interrupt 
-  outb(baseaddr + IDE_PORT_SECTORS, 8);  // number of sectors
-  outb(baseaddr + IDE_PORT_LBALOW, block & 0xff);
-  outb(baseaddr + IDE_PORT_LBAMID, (block >> 8) & 0xff);
-  outb(baseaddr + IDE_PORT_LBAHI, (block >> 16) & 0xff);
-  outb(baseaddr + IDE_PORT_DRIVE, 0xe0 | ((SWAPDEV&1)<<4) | ((block>>24)&0x0f));
-  outb(baseaddr + IDE_PORT_COMMAND, IDE_CMD_WRITE);
-  outsl(baseaddr + IDE_PORT_DATA, src, PGSIZE/4);
-	release(&idelock);
-}
+// Wait for a request queued by swapstart. The faulting
+// process sleeps while the disk works, unless it holds a
+// spinlock, in which case we poll the disk instead.
+void
+swapwait(struct idereq *r)
+{
+  int sleepok;
 
-// Read whole page without interrupts
-void readpg(char* dest, uint block) {
-	acquire(&idelock);
-  //cprintf("Starting swap read dest %p block %d\n", dest, block);
-  int status = getstatusport(SWAPDEV);
-  int baseaddr = getbaseport(SWAPDEV);
-  idewait(0,SWAPDEV);
-  outb(status, 1);  // don't generate interrupt 
-  outb(baseaddr + IDE_PORT_SECTORS, 8);  // number of sectors
-  outb(baseaddr + IDE_PORT_LBALOW, block & 0xff);
-  outb(baseaddr + IDE_PORT_LBAMID, (block >> 8) & 0xff);
-  outb(baseaddr + IDE_PORT_LBAHI, (block >> 16) & 0xff);
-  outb(baseaddr + IDE_PORT_DRIVE, 0xe0 | ((SWAPDEV&1)<<4) | ((block>>24)&0x0f));
-  outb(baseaddr + IDE_PORT_COMMAND, IDE_CMD_READ);
-  idewait(0,SWAPDEV);
-  insl(getbaseport(SWAPDEV) + IDE_PORT_DATA, dest, PGSIZE/4);
-	release(&idelock);
+  sleepok = cansleep();
+  acquire(&idelock);
+  idefinish(r, sleepok);
+  release(&idelock);
 }
@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or with
+// kalloc_order physically contiguous runs of 2^order pages.
 
 #include "types.h"
 #include "defs.h"
@@ -8,31 +9,67 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "slab.h"
 #include "swap.h"
+#include "page.h"
+#include "proc.h"
+#include "x86.h"
 
 void freerange(void *vstart, void *vend);
+static void refill(struct cpu*);
+static void drain(struct cpu*);
+static char* buddyalloc(int);
+static void buddyfree(char*, int);
 extern char end[]; // first address after kernel loaded from ELF file
-pte_t* owner[MEMORYPGCAPACITY]; //Tracking all PTEs in memory.
-
 /*
-	Owner lock needs to be called over the DURATION the
-	PTE is being modified/read -- it is not enough to call it
-	in own or disown
+	State of every frame; see page.h. A page's refs is only
+	above 1 for pages shared copy-on-write after fork or
+	through the text cache (text.c); the PTEs beyond the
+	owner are on its rmap list, so shared pages stay in the
+	replacement policy's lists too.
 */
-struct spinlock ownerlock;
-
+struct page pages[MEMORYPGCAPACITY];
 
+/*
+	The rmap lists' entries. The cache never evicts to grow,
+	since an eviction frees entries to it; rmapalloc makes
+	room itself instead.
+*/
+static struct kmem_cache rmapcache;
 
 struct run {
   struct run *next;
+  struct run *prev; // Only used on the buddy lists
 };
 
+/*
+	Free memory is kept by a buddy allocator: freelist[k] is a
+	circular list of free blocks of 2^k pages, each aligned to
+	its size. A free block's buddy is the block of the same
+	size it was split from, so freeing merges the two again
+	when both are free. The order field of the first frame's
+	struct page holds the block's order+1, and is 0 everywhere
+	else.
+*/
+#define MAXORDER 10 // 4MB blocks
+
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run freelist[MAXORDER+1];
+  uint nfree[MAXORDER+1]; // Free blocks of each order
+  uint nsplit;
+  uint ncoalesce;
 } kmem;
 
+/*
+	Once kinit2 is done, each cpu keeps a small cache of free
+	pages in cpu->freepages, so that kalloc and kfree only need
+	kmem.lock to move PCBATCH pages at a time between the cache
+	and the buddy lists. Touched only with interrupts off.
+*/
+#define PCBATCH 16
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -41,8 +78,14 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int k;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+  for(k = 0; k <= MAXORDER; k++)
+    kmem.freelist[k].next = kmem.freelist[k].prev = &kmem.freelist[k];
+  kmem_cache_init(&rmapcache, "rmap", sizeof(struct rmap));
+  rmapcache.noevict = 1;
   freerange(vstart, vend);
 }
 
@@ -81,8 +124,9 @@ void
 kfree(char *v, int swappable,pte_t* expected_pte)
 {
   struct run *r;
-  uint vidx = v2p(v)/PGSIZE;
+  struct page *pg;
   uint diskslot;
+  pte_t* pte;
 
 	// In disk; just need to free swap space.
   if (swappable && PTE_ONDISK(*expected_pte)) {
@@ -92,31 +136,81 @@ kfree(char *v, int swappable,pte_t* expected_pte)
   }
   if((uint)v % PGSIZE || v < end || v2p(v) >= PHYSTOP)
     panic("kfree2");
-  // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
-
-
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  pg = PAGE(v);
 
 	//Need to check swap.
   if (swappable) {
-		acquire(&ownerlock);
-    pte_t* pte = owner[vidx];
+		lockpage(v);
+    if (!(*expected_pte & PTE_P) || PTE_ADDR(*expected_pte) != v2p(v)) {
+      // Evicted since the caller looked; v isn't ours to free.
+      unlockpage(v);
+      if (PTE_ONDISK(*expected_pte)) {
+        freeswapfree(((uint)*expected_pte) >> 12);
+      }
+      return;
+    }
+    if (pg->refs > 1) { //Another page table still maps it
+      rmapdel(v, expected_pte);
+      unlockpage(v);
+      return;
+    }
+    pg->refs = 0;
+    pte = pg->owner;
     if (expected_pte == pte) { //The page is still in memory
       disown(v);
       scnoderemove(v);
     }
-    else {
+    else if (pte != PG_UNOWNED) { //Unowned if it was shared
       panic("kfree: Wrong owner!");
     }
-		release(&ownerlock);
+    swapuncache(v);
+		unlockpage(v);
   }
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  else {
+    pg->refs = 0;
+  }
+
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE);
+
+  r = (struct run*)v;
+  if(!kmem.use_lock){
+    buddyfree(v, 0);
+    return;
+  }
+  pushcli();
+  r->next = cpu->freepages;
+  cpu->freepages = r;
+  if(++cpu->nfreepages >= 2*PCBATCH)
+    drain(cpu);
+  popcli();
+}
+
+// Take a page off this cpu's cache or the buddy lists.
+static struct run*
+freepage(void)
+{
+  struct run *r;
+  if(!kmem.use_lock){
+    r = (struct run*)buddyalloc(0);
+  } else {
+    pushcli();
+    if(cpu->nfreepages == 0)
+      refill(cpu);
+    r = cpu->freepages;
+    if(r){
+      cpu->freepages = r->next;
+      cpu->nfreepages--;
+    }
+    popcli();
+  }
+
+  if(r) {
+    if (PAGE(r)->owner != PG_UNOWNED) {
+      panic("Alloc an owned page");
+    }
+  }
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -126,49 +220,370 @@ char*
 kalloc(int swappable)
 {
   struct run *r;
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
 
-  if(r) {
-    kmem.freelist = r->next;
-    if (owner[v2p(r)/PGSIZE] != PG_UNOWNED) {
-      panic("Alloc an owned page");
-    }
-  }
+  r = freepage();
+  if(kmem.use_lock && kfreepages() < FREELOW)
+    kswapdwake();
 	// Out of memory, need to evict.
-  else {
-    if(kmem.use_lock)
-      release(&kmem.lock);
-		acquire(&ownerlock);
+  if(!r) {
     r = (struct run*)swappage();
-		release(&ownerlock);
     //cprintf("Kalloc: %p\n",r);
-    if(kmem.use_lock)
-      acquire(&kmem.lock);
   }
 
+  if (r) {
+    PAGE(r)->refs = 1;
+  }
   if (r && swappable) {
     scnodeenqueue(r); //Page is eligible for swapping by being in the queue
   }
+
+  return (char*)r;
+}
+
+// Like kalloc(0), but returns 0 instead of evicting a page
+// when memory is full, for use while evicting (zswap.c).
+char*
+kalloc_noevict(void)
+{
+  struct run *r;
+
+  if((r = freepage()) != 0)
+    PAGE(r)->refs = 1;
+  return (char*)r;
+}
+
+// Number of free pages, for kswapd's watermarks.
+// Doesn't lock, so only roughly right.
+uint
+kfreepages(void)
+{
+  uint k, n;
+  struct cpu *c;
+
+  n = 0;
+  for(k = 0; k <= MAXORDER; k++)
+    n += kmem.nfree[k] << k;
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    n += c->nfreepages;
+  return n;
+}
+
+// Move up to PCBATCH pages from the buddy lists to c's cache.
+// Interrupts must be off.
+static void
+refill(struct cpu *c)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(c->nfreepages < PCBATCH && (r = (struct run*)buddyalloc(0)) != 0){
+    r->next = c->freepages;
+    c->freepages = r;
+    c->nfreepages++;
+  }
+  release(&kmem.lock);
+}
+
+// Give PCBATCH pages from c's cache back to the buddy lists.
+// Interrupts must be off.
+static void
+drain(struct cpu *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < PCBATCH && (r = c->freepages) != 0; i++){
+    c->freepages = r->next;
+    c->nfreepages--;
+    buddyfree((char*)r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Take a block of 2^order pages off the buddy lists, splitting
+// a larger block if there is none that size.  Returns 0 if no
+// block is big enough.  Caller must hold kmem.lock (once used).
+static char*
+buddyalloc(int order)
+{
+  struct run *r, *head;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(kmem.freelist[k].next != &kmem.freelist[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+  r = kmem.freelist[k].next;
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[k]--;
+  PAGE(r)->order = 0;
+
+  // Put the unused upper halves back, one order at a time.
+  while(k > order){
+    k--;
+    head = (struct run*)((char*)r + (PGSIZE << k));
+    head->next = kmem.freelist[k].next;
+    head->prev = &kmem.freelist[k];
+    head->next->prev = head;
+    kmem.freelist[k].next = head;
+    kmem.nfree[k]++;
+    PAGE(head)->order = k + 1;
+    kmem.nsplit++;
+  }
+  return (char*)r;
+}
+
+// Return a block of 2^order pages to the buddy lists, merging
+// it with its buddy for as long as the buddy is free too.
+// Caller must hold kmem.lock (once used).
+static void
+buddyfree(char *v, int order)
+{
+  struct run *r;
+  uint pfn, bpfn;
+
+  pfn = v2p(v)/PGSIZE;
+  while(order < MAXORDER){
+    bpfn = pfn ^ (1 << order);
+    if(bpfn >= MEMORYPGCAPACITY || pages[bpfn].order != order + 1)
+      break;
+    r = (struct run*)p2v(bpfn*PGSIZE);
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    kmem.nfree[order]--;
+    pages[bpfn].order = 0;
+    kmem.ncoalesce++;
+    pfn &= ~(1 << order);
+    order++;
+  }
+  r = (struct run*)p2v(pfn*PGSIZE);
+  r->next = kmem.freelist[order].next;
+  r->prev = &kmem.freelist[order];
+  r->next->prev = r;
+  kmem.freelist[order].next = r;
+  kmem.nfree[order]++;
+  pages[pfn].order = order + 1;
+}
+
+// Allocate 2^order physically contiguous pages, for callers
+// that need more than one page (e.g. DMA buffers). The pages
+// are never swapped.  Returns 0 if no such block is free.
+char*
+kalloc_order(int order)
+{
+  char *v;
+
+  if(order == 0)
+    return kalloc(0);
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  v = buddyalloc(order);
   if(kmem.use_lock)
     release(&kmem.lock);
+  return v;
+}
 
-  return (char*)r;
+// Free a block returned by kalloc_order(order).
+void
+kfree_order(char *v, int order)
+{
+  if(order == 0){
+    kfree(v, 0, 0);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || (v2p(v)/PGSIZE) % (1 << order) ||
+     v < end || v2p(v) + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddyfree(v, order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Print free block counts and split/coalesce totals.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  uint k, nfree, largest;
+
+  nfree = 0;
+  largest = 0;
+  cprintf("buddy free blocks by order:");
+  for(k = 0; k <= MAXORDER; k++){
+    cprintf(" %d", kmem.nfree[k]);
+    nfree += kmem.nfree[k] << k;
+    if(kmem.nfree[k])
+      largest = k;
+  }
+  cprintf("\n%d pages free, largest block 2^%d pages, "
+          "%d%% of free pages in smaller blocks\n",
+          nfree, largest,
+          nfree ? 100 - (kmem.nfree[largest] << largest) * 100 / nfree : 0);
+  cprintf("%d splits, %d coalesces\n", kmem.nsplit, kmem.ncoalesce);
+}
+
+/*
+	Page locks. Each user page has a spin lock of its own,
+	the PG_LOCKED bit of its flags, so that faults and
+	eviction only wait for each other when they work on the
+	same page. As with spinlocks, interrupts are off while
+	one is held. A cpu holding a page lock may only take
+	another with trylockpage, and must give up if it is busy.
+*/
+
+// Set pg's lock bit if it is clear. Returns 1 if it was.
+static int
+pagetas(struct page* pg) {
+  uint f = pg->flags;
+
+  return !(f & PG_LOCKED) && cmpxchg(&pg->flags, f, f | PG_LOCKED) == f;
+}
+
+void
+lockpage(char* va) {
+  pushcli();
+  // Do any TLB shootdown asked of this cpu while waiting,
+  // as acquire does.
+  while (!pagetas(PAGE(va))) {
+    tlbpoll();
+  }
+}
+
+// Lock the page at va if nobody holds it. Returns 1 if locked.
+int
+trylockpage(char* va) {
+  pushcli();
+  if (pagetas(PAGE(va))) {
+    return 1;
+  }
+  popcli();
+  return 0;
 }
 
+void
+unlockpage(char* va) {
+  struct page* pg = PAGE(va);
 
+  if (!(pg->flags & PG_LOCKED)) {
+    panic("unlockpage");
+  }
+  // Other flags only change with the lock held.
+  xchg(&pg->flags, pg->flags & ~PG_LOCKED);
+  popcli();
+}
+
+// The page at va now has its first mapping, pte.
+// The page's lock must be held.
 void
 own(char* va, pte_t* pte) {
-  if (owner[v2p(va)/PGSIZE] != PG_UNOWNED) {
+  if (PAGE(va)->owner != PG_UNOWNED) {
     panic("Attempt to own an owned page");
   }
-  owner[v2p(va)/PGSIZE] = pte;
+  PAGE(va)->owner = pte;
 }
 
+/*
+	Forget every mapping of the page at va; it has been
+	evicted. The page's lock must be held.
+*/
 void disown(char* va) {
-  if (owner[v2p(va)/PGSIZE] == PG_UNOWNED) {
+  struct page *pg = PAGE(va);
+  struct rmap *r;
+
+  if (pg->owner == PG_UNOWNED) {
     panic("Attempt to disown an unowned page");
   }
-  owner[v2p(va)/PGSIZE] = PG_UNOWNED;
+  pg->owner = PG_UNOWNED;
+  while ((r = pg->rmap) != 0) {
+    pg->rmap = r->next;
+    kmem_cache_free(&rmapcache, r);
+  }
+}
+
+/*
+	Get an rmap entry for rmapadd. Must not be called with
+	a page locked, since it may have to evict a page to
+	make room. Returns 0 if out of memory.
+*/
+struct rmap*
+rmapalloc(void) {
+  struct rmap *r;
+  char *pg;
+
+  while ((r = kmem_cache_alloc(&rmapcache)) == 0) {
+    if ((pg = swappage()) == 0)
+      return 0;
+    kfree(pg, 0, 0);
+  }
+  return r;
+}
+
+// Free an rmap entry that rmapadd didn't need.
+void
+rmapfree(struct rmap* r) {
+  kmem_cache_free(&rmapcache, r);
+}
+
+/*
+	Another page table now maps the page at va through pte
+	(copy-on-write fork); r comes from rmapalloc. The
+	page's lock must be held.
+*/
+void
+rmapadd(char* va, pte_t* pte, struct rmap* r) {
+  struct page *pg = PAGE(va);
+
+  if (pg->owner == PG_UNOWNED) {
+    panic("rmapadd of unowned page");
+  }
+  r->pte = pte;
+  r->next = pg->rmap;
+  pg->rmap = r;
+  pg->refs++;
+}
+
+/*
+	pte no longer maps the page at va, which some other
+	page table still maps. The page's lock must be held.
+*/
+void
+rmapdel(char* va, pte_t* pte) {
+  struct page *pg = PAGE(va);
+  struct rmap **rp, *r;
+
+  if (pg->refs < 2) {
+    panic("rmapdel of unshared page");
+  }
+  if (pg->owner == pte) {
+    // Hand ownership to another mapping.
+    r = pg->rmap;
+    pg->owner = r->pte;
+    pg->rmap = r->next;
+  } else {
+    for (rp = &pg->rmap; *rp && (*rp)->pte != pte; rp = &(*rp)->next)
+      ;
+    if ((r = *rp) == 0) {
+      panic("rmapdel: no such mapping");
+    }
+    *rp = r->next;
+  }
+  kmem_cache_free(&rmapcache, r);
+  pg->refs--;
+}
+
+// Number of page tables mapping the page at va.
+// The page's lock must be held.
+int
+krefs(char* va) {
+  return PAGE(va)->refs;
 }
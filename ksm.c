@@ -0,0 +1,180 @@
+// Same-page merging.
+//
+// ksmd, a kernel process started by main if KSMPAGES (set in
+// the Makefile) isn't 0, looks at KSMPAGES frames every
+// KSMTICKS ticks, going round all of memory.  A user page
+// mapped by a single page table whose contents haven't
+// changed since the last pass is merged with an identical
+// page seen before: its PTE is pointed at that page, shared
+// copy-on-write as after fork, and its frame is freed.  Pages
+// of zeros are merged into the zero page instead.
+//
+// Pages are only found through a table of the last page seen
+// with each checksum, so identical pages are missed if their
+// checksums collide with other pages'.  Both pages are
+// locked, made read-only and flushed from every TLB before
+// they are compared, so neither can change until the merge
+// is done; if they differ, the next write to either takes it
+// back (cowpage).  A page whose lock is busy is left for the
+// next pass.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "page.h"
+
+#define KSMTICKS 10
+#define NKSMHASH 1024
+
+static struct {
+  char *seen[NKSMHASH];   // Last page seen with each checksum
+  uint next;              // Frame to look at next
+  uint nscan, nmerge, nzero;
+} ksm;
+
+static uint
+ksmsum(char *pg)
+{
+  uint *w, h;
+
+  h = 0;
+  for(w = (uint*)pg; w < (uint*)(pg + PGSIZE); w++)
+    h = (h ^ *w) * 16777619;
+  return h;
+}
+
+// Make pte read-only, copy-on-write if it was writable.
+// Caller holds the lock of the page it maps and must
+// tlbshootdown.
+static void
+ksmprotect(pte_t *pte)
+{
+  if(*pte & PTE_W){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    tlbflushpte(pte);
+  }
+}
+
+// Merge the page at pg, a user page with one mapping, into
+// the page at into, which may be zeropg.
+// Returns 1 if they were the same and merged, else 0.
+static int
+ksmmerge(char *pg, char *into)
+{
+  struct page *p, *q;
+  struct rmap *r, *m;
+  pte_t *pte;
+  int merged;
+
+  r = 0;
+  if(into != zeropg && (r = rmapalloc()) == 0)
+    return 0;
+  merged = 0;
+  lockpage(pg);
+  if(into != zeropg && !trylockpage(into)){
+    unlockpage(pg);
+    rmapfree(r);
+    return 0;
+  }
+  p = PAGE(pg);
+  q = PAGE(into);
+  pte = p->owner;
+  // Either may have changed hands since ksmscan looked.
+  // A page pinned for a system call must stay writable.
+  if(pte == PG_UNOWNED || p->refs != 1 || p->pins || !(*pte & PTE_U) ||
+     (into != zeropg && (q->owner == PG_UNOWNED || q->pins ||
+                         textpage(into) || (q->flags & PG_SHARED))))
+    goto out;
+  ksmprotect(pte);
+  if(into != zeropg){
+    ksmprotect(q->owner);
+    for(m = q->rmap; m; m = m->next)
+      ksmprotect(m->pte);
+  }
+  tlbshootdown();
+  if(memcmp(pg, into, PGSIZE) != 0)
+    goto out;
+  *pte = v2p(into) | (PTE_FLAGS(*pte) & ~PTE_D);
+  tlbflushpte(pte);
+  tlbshootdown();
+  if(into != zeropg){
+    rmapadd(into, pte, r);
+    r = 0;
+  }
+  disown(pg);
+  scnoderemove(pg);
+  swapuncache(pg);
+  merged = 1;
+out:
+  if(into != zeropg)
+    unlockpage(into);
+  unlockpage(pg);
+  if(r)
+    rmapfree(r);
+  if(merged)
+    kfree(pg, 0, 0);
+  return merged;
+}
+
+// Look at the next n frames.
+static void
+ksmscan(int n)
+{
+  struct page *p;
+  char *pg, *into;
+  uint sum;
+
+  for(; n > 0; n--){
+    p = &pages[ksm.next];
+    ksm.next = (ksm.next + 1) % MEMORYPGCAPACITY;
+    // Racy, but ksmmerge checks again with the page locked.
+    if(p->owner == PG_UNOWNED || p->refs != 1)
+      continue;
+    pg = PAGEVA(p);
+    ksm.nscan++;
+    sum = ksmsum(pg);
+    if(p->ksmsum != sum + 1){
+      p->ksmsum = sum + 1;  // Still changing; try next pass
+      continue;
+    }
+    if(sum == 0 && ksmmerge(pg, zeropg)){
+      ksm.nzero++;
+      continue;
+    }
+    into = ksm.seen[sum % NKSMHASH];
+    if(into && into != pg && PAGE(into)->ksmsum == sum + 1 &&
+       ksmmerge(pg, into)){
+      ksm.nmerge++;
+      continue;
+    }
+    ksm.seen[sum % NKSMHASH] = pg;
+  }
+}
+
+// Same-page merging daemon, a kernel process started by main.
+void
+ksmd(void)
+{
+  uint t;
+
+  for(;;){
+    acquire(&tickslock);
+    t = ticks;
+    while(ticks - t < KSMTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    ksmscan(KSMPAGES);
+  }
+}
+
+// Print merge counts.
+// Runs when user types ^V on console.
+void
+ksmdump(void)
+{
+  cprintf("ksm: %d pages scanned, %d merged, %d into the zero page\n",
+          ksm.nscan, ksm.nmerge, ksm.nzero);
+}
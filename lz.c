@@ -0,0 +1,133 @@
+// Small LZ77 compressor, used to keep swapped out pages
+// compressed in RAM (see zswap.c).
+//
+// Compressed data is a sequence of groups: a control byte,
+// then up to 8 items, each a literal byte if its bit in the
+// control byte is clear, or else a match copying bytes from
+// earlier in the output. A match is two bytes: a 12 bit
+// offset back and a 4 bit length less LZMINMATCH; a length
+// field of 15 is followed by extra length bytes, each 255
+// meaning another follows.
+
+#include "types.h"
+#include "defs.h"
+
+#define LZMINMATCH 3
+#define LZMAXOFF   4095
+#define LZHASHBITS 12
+
+#define LZHASH(p) \
+  ((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - LZHASHBITS))
+
+// Last position+1 of each hashed 3-byte string.
+// Not reentrant: callers must serialize lzcompress,
+// which zswap.c does by holding swapiolock.
+static ushort lzhash[1 << LZHASHBITS];
+
+// Compress n (at most 65535) bytes at src into dst, which
+// holds max bytes.  Returns the compressed length, or -1
+// if it doesn't fit.
+int
+lzcompress(uchar *src, int n, uchar *dst, int max)
+{
+  uchar *ctl;
+  int i, o, h, cand, len, l, nitem;
+
+  memset(lzhash, 0, sizeof(lzhash));
+  ctl = 0;
+  nitem = 8;
+  o = 0;
+  for(i = 0; i < n; nitem++){
+    if(nitem == 8){
+      if(o >= max)
+        return -1;
+      ctl = &dst[o++];
+      *ctl = 0;
+      nitem = 0;
+    }
+    len = 0;
+    cand = 0;
+    if(i + LZMINMATCH <= n){
+      h = LZHASH(src + i);
+      cand = lzhash[h] - 1;
+      lzhash[h] = i + 1;
+      if(cand >= 0 && i - cand <= LZMAXOFF &&
+         src[cand] == src[i] && src[cand+1] == src[i+1] &&
+         src[cand+2] == src[i+2]){
+        len = LZMINMATCH;
+        while(i + len < n && src[cand+len] == src[i+len])
+          len++;
+      }
+    }
+    if(len == 0){
+      if(o >= max)
+        return -1;
+      dst[o++] = src[i++];
+      continue;
+    }
+    if(o + 2 > max)
+      return -1;
+    l = len - LZMINMATCH;
+    dst[o++] = (i - cand) >> 4;
+    dst[o++] = ((i - cand) & 0xf) << 4 | (l < 15 ? l : 15);
+    if(l >= 15){
+      for(l -= 15; ; l -= 255){
+        if(o >= max)
+          return -1;
+        if(l < 255){
+          dst[o++] = l;
+          break;
+        }
+        dst[o++] = 255;
+      }
+    }
+    *ctl |= 1 << nitem;
+    i += len;
+  }
+  return o;
+}
+
+// Expand len bytes at src, from lzcompress, into dst,
+// which holds n bytes.  Returns the expanded length,
+// or -1 if src is corrupt.
+int
+lzdecompress(uchar *src, int len, uchar *dst, int n)
+{
+  uchar ctl;
+  int i, o, off, l, nitem;
+
+  ctl = 0;
+  nitem = 8;
+  o = 0;
+  for(i = 0; i < len; nitem++){
+    if(nitem == 8){
+      ctl = src[i++];
+      nitem = -1;
+      continue;
+    }
+    if(!(ctl & (1 << nitem))){
+      if(o >= n)
+        return -1;
+      dst[o++] = src[i++];
+      continue;
+    }
+    if(i + 2 > len)
+      return -1;
+    off = src[i] << 4 | src[i+1] >> 4;
+    l = src[i+1] & 0xf;
+    i += 2;
+    if(l == 15){
+      do {
+        if(i >= len)
+          return -1;
+        l += src[i];
+      } while(src[i++] == 255);
+    }
+    l += LZMINMATCH;
+    if(off == 0 || off > o || o + l > n)
+      return -1;
+    for(; l > 0; l--, o++)
+      dst[o] = dst[o - off];   // may overlap, so byte by byte
+  }
+  return o;
+}
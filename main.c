@@ -31,7 +31,10 @@ main(void)
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
+  pipeinit();      // pipe buffers
   iinit();         // inode cache
+  textinit();      // executable page cache
+  shareinit();     // MAP_SHARED page cache
   ideinit();       // disk
   if(!ismp)
     timerinit();   // uniprocessor timer
@@ -39,6 +42,9 @@ main(void)
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
   swapinit();      // init swap
   userinit();      // first user process
+  kproc("kswapd", kswapd); // page-out daemon
+  if(KSMPAGES)
+    kproc("ksmd", ksmd);   // same-page merging
   // Finish setting up this processor in mpmain.
   mpmain();
 }
@@ -0,0 +1,15 @@
+// Advice for madvise about how memory will be used.
+#define MADV_NORMAL     0  // No particular order
+#define MADV_SEQUENTIAL 1  // In address order, each page once
+#define MADV_WILLNEED   2  // Soon: bring it in now
+#define MADV_DONTNEED   3  // Not any more: drop the contents
+#define MADV_COLD       4  // Not soon: evict it first
+
+// Protection and sharing for mmap.  Processes mapping a page
+// of a file MAP_SHARED share one copy of it, which is written
+// to the file when any of them unmaps it, including by exec
+// and exit; a child of fork shares it too.
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define MAP_SHARED      0x1
+#define MAP_PRIVATE     0x2
@@ -38,6 +38,7 @@
 #define CR0_PG          0x80000000      // Paging
 
 #define CR4_PSE         0x00000010      // Page size extension
+#define CR4_PGE         0x00000080      // Page global enable
 
 #define SEG_KCODE 1  // kernel code
 #define SEG_KDATA 2  // kernel data+stack
@@ -138,8 +139,10 @@ struct segdesc {
 #define PTE_A           0x020   // Accessed
 #define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global; kept in the TLB across %cr3 loads
 #define PTE_MBZ         0x180   // Bits must be zero
 #define PTE_AVAIL       0x200   // Is the page available or is it on disk?
+#define PTE_COW         0x400   // Shared after fork; copy before writing
 
 #define PTE_ONDISK(pte) (((uint)pte & PTE_AVAIL) && (!((uint)pte & PTE_P)))
 // Address in page table or page directory entry
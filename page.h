@@ -0,0 +1,51 @@
+// Per-frame state: one struct page for each physical page,
+// in pages[] (kalloc.c).
+//
+// A user page's lock (PG_LOCKED, see lockpage) protects its
+// owner, rmap, refs, pins and swapslot, and the PTEs mapping it: a
+// present PTE is only changed by a holder of the lock of the
+// page it maps, except by its own process while it is the
+// page's only mapping and not yet owned.  next, prev, age
+// and queue are protected by sclock (swap.c), and order by
+// kmem.lock.  pde is set by walkpgdir when it allocates a
+// page table.  Only ksmd uses ksmsum.
+struct page {
+	uint flags;         // PG_ bits below
+	pte_t* owner;       // A PTE mapping it, if evictable
+	struct rmap* rmap;  // The other PTEs mapping it
+	struct page* next;  // Replacement policy lists (policy.c)
+	struct page* prev;
+	uint swapslot;      // Swap cache: slot it was read from, plus one,
+	                    // while clean, so evicting it again needs no
+	                    // write; holds the PTE's reference to the slot
+	uchar refs;         // Page tables mapping it
+	uchar order;        // Buddy: order+1 at the head of a free block
+	uchar age;          // aging: reference bits of the last 8 periods
+	uchar queue;        // 2q: which list the page is on
+	uchar pins;         // System calls using it (populate)
+	pde_t* pde;         // Page table pages: the PDE pointing at it
+	uint ksmsum;        // ksm.c: checksum at its last look, plus one
+};
+
+// Reverse mapping: a page mapped by several page tables
+// (shared copy-on-write by fork, or an executable's page
+// in the text cache) has one mapping in owner
+// and the rest on a list of these, so that eviction can
+// find and rewrite every PTE.
+struct rmap {
+	pte_t* pte;
+	struct rmap* next;
+};
+
+#define MEMORYPGCAPACITY (TOTALMAINBYTES/PGSIZE)
+
+#define PG_UNOWNED 0
+
+#define PG_LOCKED 0x1       // lockpage
+#define PG_SHARED 0x2       // In the MAP_SHARED page cache (share.c)
+
+extern struct page pages[];
+
+// The struct page of kernel address va, and back.
+#define PAGE(va)   (&pages[v2p(va)/PGSIZE])
+#define PAGEVA(pg) ((char*)p2v(((pg) - pages) * PGSIZE))
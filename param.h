@@ -2,12 +2,19 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
+#define NVMA         16  // memory areas per process
+#define NPIN          4  // user buffers pinned by one system call
 #define NBUF         10  // size of disk block cache
-#define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define SWAPDEV		  3  // device number of the swap disk
 #define MAXARG       32  // max exec arguments
 #define LOGSIZE      10  // max data sectors in on-disk log
+#define SWAPCLUSTER   8  // max pages written to swap in one eviction
+#define SWAPREADAHEAD 4  // max pages read from swap in one fault
+#define ZSWAPMAX    512  // max swapped pages kept compressed in RAM, 0 for none
+#define NTEXTPAGE   256  // executable pages kept shared between processes
+#define NTEXTINODE  61   // buckets counting executable pages by inode
+#define FREELOW      32  // kswapd wakes when fewer pages are free
+#define FREEHIGH     64  // and evicts until this many are
 
@@ -0,0 +1,341 @@
+// Page replacement policies.
+//
+// Each policy keeps the evictable pages, linked through
+// their struct pages, in its own order and picks which one
+// to evict. The policy is chosen when the kernel is built
+// (make SWAPPOLICY=clock; fifo by default), and swap.c
+// looks it up by that name at boot and calls it with sclock
+// held. A page's PTEs are only looked at with its lock,
+// which choose and tick take with trylockpage, since
+// sclock is taken with page locks held; choose returns its
+// page still locked.
+//
+// Pages that are queued but not owned yet (just returned by
+// kalloc), pages pinned for a system call (populate),
+// MAP_SHARED frames that a process maps (share.c),
+// or pages locked by someone else, count as referenced, so
+// they are never chosen.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "swap.h"
+#include "page.h"
+
+static struct page q[2];     // Sentinels of circular lists
+static uint nq[2];           // Pages on each list (2q)
+static struct page* hand;    // Next page the clock looks at
+
+// Must the page stay, whatever its reference bits say? It
+// isn't owned yet, a system call is using it (populate), or
+// it is a MAP_SHARED frame that a process maps (share.c).
+// Caller holds its lock.
+static int
+pinned(struct page* n)
+{
+	return n->owner == PG_UNOWNED || n->pins ||
+		((n->flags & PG_SHARED) && n->refs > 1);
+}
+
+// Has the page been accessed through any of its
+// mappings since we last looked? Caller holds its lock.
+static int
+isreferenced(struct page* n)
+{
+	struct rmap* r;
+
+	if (pinned(n) || (*n->owner & PTE_A)) {
+		return 1;
+	}
+	for (r = n->rmap; r; r = r->next) {
+		if (*r->pte & PTE_A) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Caller holds n's lock.
+static void
+setunreferenced(struct page* n)
+{
+	struct rmap* r;
+
+	// The TLB entry must go too, or the cpu won't set
+	// PTE_A again on the next access.
+	if (n->owner != PG_UNOWNED) {
+		*n->owner &= ~PTE_A;
+		tlbflushpte(n->owner);
+	}
+	for (r = n->rmap; r; r = r->next) {
+		*r->pte &= ~PTE_A;
+		tlbflushpte(r->pte);
+	}
+}
+
+// Link n in just before at.
+static void
+qlink(struct page* at, struct page* n)
+{
+	n->next = at;
+	n->prev = at->prev;
+	at->prev->next = n;
+	at->prev = n;
+}
+
+static void
+qunlink(struct page* n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->next = 0;
+	n->prev = 0;
+}
+
+// Lock n if it can be evicted now: not locked by anyone
+// else, and unreferenced. Otherwise clear its reference
+// bit, if it could be locked, and return 0.
+static int
+lockvictim(struct page* n)
+{
+	if (!trylockpage(PAGEVA(n))) {
+		return 0;
+	}
+	if (!isreferenced(n)) {
+		return 1;
+	}
+	setunreferenced(n);
+	unlockpage(PAGEVA(n));
+	return 0;
+}
+
+/*
+	fifo: second chance. New pages go to the tail; a
+	referenced page at the head loses its bit and goes
+	back to the tail.
+*/
+static void
+fifoinsert(struct page* n)
+{
+	qlink(&q[0], n);
+}
+
+static void
+fiforemove(struct page* n)
+{
+	qunlink(n);
+}
+
+static void
+fifocold(struct page* n)
+{
+	qunlink(n);
+	qlink(q[0].next, n);
+}
+
+static struct page*
+fifochoose(uint npages)
+{
+	struct page* n;
+	uint i;
+
+	for (i = 0; i <= 2*npages; i++) {
+		n = q[0].next;
+		if (lockvictim(n)) {
+			return n;
+		}
+		qunlink(n);
+		qlink(&q[0], n);
+	}
+	return 0;
+}
+
+/*
+	clock: second chance without moving pages. The hand
+	sweeps the ring clearing reference bits and stops at
+	the first unreferenced page. New pages go just behind
+	the hand, so they are looked at last.
+*/
+static void
+clockinsert(struct page* n)
+{
+	qlink(hand, n);
+}
+
+static void
+clockremove(struct page* n)
+{
+	if (hand == n) {
+		hand = n->next;
+	}
+	qunlink(n);
+}
+
+static void
+clockcold(struct page* n)
+{
+	clockremove(n);
+	qlink(hand, n);
+	hand = n;
+}
+
+static struct page*
+clockchoose(uint npages)
+{
+	struct page* n;
+	uint i;
+
+	for (i = 0; i <= 2*npages + 1; i++) {
+		n = hand;
+		hand = n->next;
+		if (n == &q[0]) {
+			continue;
+		}
+		if (lockvictim(n)) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+/*
+	aging: every AGETICKS ticks each page's reference bit
+	is shifted into the top of its 8-bit age, and the page
+	with the lowest age is evicted, the oldest on ties.
+*/
+static void
+aginginsert(struct page* n)
+{
+	n->age = 0x80; // As if just referenced
+	qlink(&q[0], n);
+}
+
+static void
+agingcold(struct page* n)
+{
+	n->age = 0;
+	fifocold(n);
+}
+
+static void
+agingtick(void)
+{
+	struct page* n;
+
+	for (n = q[0].next; n != &q[0]; n = n->next) {
+		if (!trylockpage(PAGEVA(n))) {
+			n->age = (n->age >> 1) | 0x80;
+			continue;
+		}
+		n->age = (n->age >> 1) | (isreferenced(n) ? 0x80 : 0);
+		setunreferenced(n);
+		unlockpage(PAGEVA(n));
+	}
+}
+
+static struct page*
+agingchoose(uint npages)
+{
+	struct page* n;
+	struct page* best = 0;
+
+	for (n = q[0].next; n != &q[0]; n = n->next) {
+		if ((best && n->age >= best->age) || !trylockpage(PAGEVA(n))) {
+			continue;
+		}
+		if (pinned(n)) {
+			unlockpage(PAGEVA(n));
+			continue;
+		}
+		if (best) {
+			unlockpage(PAGEVA(best));
+		}
+		best = n;
+		if (n->age == 0) {
+			break;
+		}
+	}
+	return best;
+}
+
+/*
+	2q: new pages wait on a FIFO (q[0]). Those referenced
+	while there are promoted to a second chance queue of
+	hot pages (q[1]). The FIFO is evicted from while it
+	holds more than a quarter of the pages, so a single
+	pass through a lot of memory can't push out the hot
+	pages. Simplified: there is no list of recently
+	evicted pages, so a page is only promoted if it is
+	referenced again before it leaves the FIFO.
+*/
+static void
+twoqinsert(struct page* n)
+{
+	n->queue = 0;
+	qlink(&q[0], n);
+	nq[0]++;
+}
+
+static void
+twoqremove(struct page* n)
+{
+	nq[n->queue]--;
+	qunlink(n);
+}
+
+static void
+twoqcold(struct page* n)
+{
+	twoqremove(n);
+	n->queue = 0;
+	qlink(q[0].next, n);
+	nq[0]++;
+}
+
+static struct page*
+twoqchoose(uint npages)
+{
+	struct page* n;
+	uint i, l;
+
+	for (i = 0; i <= 2*npages; i++) {
+		l = (nq[0] > npages/4 || nq[1] == 0) ? 0 : 1;
+		n = q[l].next;
+		if (lockvictim(n)) {
+			return n;
+		}
+		twoqremove(n);
+		n->queue = 1;
+		qlink(&q[1], n);
+		nq[1]++;
+	}
+	return 0;
+}
+
+static struct swappolicy policies[] = {
+	{ "fifo",  fifoinsert,  fiforemove,  fifocold,  fifochoose,  0 },
+	{ "clock", clockinsert, clockremove, clockcold, clockchoose, 0 },
+	{ "aging", aginginsert, fiforemove,  agingcold, agingchoose, agingtick },
+	{ "2q",    twoqinsert,  twoqremove,  twoqcold,  twoqchoose,  0 },
+};
+
+// Set up the lists and return the policy called name,
+// or the first one if there is none by that name.
+struct swappolicy*
+policyinit(char* name)
+{
+	struct swappolicy* p;
+
+	q[0].next = q[0].prev = &q[0];
+	q[1].next = q[1].prev = &q[1];
+	hand = &q[0];
+	for (p = policies; p < &policies[NELEM(policies)]; p++) {
+		if (strncmp(p->name, name, 16) == 0) {
+			return p;
+		}
+	}
+	cprintf("swap: no policy %s, using %s\n", name, policies[0].name);
+	return &policies[0];
+}
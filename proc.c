@@ -87,6 +87,7 @@ userinit(void)
     panic("userinit: out of memory?");
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
   p->sz = PGSIZE;
+  vmafill(p->vma, &p->nvma, 0, PGSIZE, PTE_W);
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -102,7 +103,26 @@ userinit(void)
   p->state = RUNNABLE;
 }
 
+// Start a kernel process running fn, which must never return.
+// It has no user memory; its page table maps only the kernel.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kproc: out of memory?");
+  // forkret returns into fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+}
+
 // Grow current process's memory by n bytes.
+// Growing only reserves the address space; pages are
+// zero filled on first touch (see segflthandler).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -111,14 +131,22 @@ growproc(int n)
   
   sz = proc->sz;
   if(n > 0){
-    if((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
+    if(sz + n >= KERNBASE || sz + n < sz)
+      return -1;
+    if(!vmafree(proc->vma, proc->nvma, PGROUNDUP(sz), PGROUNDUP(sz + n)))
+      return -1;  // would run into an mmap
+    if(vmafill(proc->vma, &proc->nvma, PGROUNDUP(sz),
+               PGROUNDUP(sz + n), PTE_W) < 0)
       return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0)
       return -1;
+    vmaremove(proc->vma, &proc->nvma, PGROUNDUP(sz), PGROUNDUP(proc->sz));
   }
+  // Growing maps nothing until the first touch, and
+  // deallocuvm flushes what it unmaps, so no %cr3 reload.
   proc->sz = sz;
-  switchuvm(proc);
   return 0;
 }
 
@@ -136,9 +164,12 @@ fork(void)
     return -1;
 
   // Copy process state from p.
-  if((np->pgdir = copyuvm(proc->pgdir, proc->sz)) == 0){
+  memmove(np->vma, proc->vma, sizeof(proc->vma));
+  np->nvma = proc->nvma;
+  if((np->pgdir = copyuvm(proc->pgdir, np->vma, np->nvma)) == 0){
     kfree(np->kstack,0,0);
     np->kstack = 0;
+    np->nvma = 0;
     np->state = UNUSED;
     return -1;
   }
@@ -153,6 +184,7 @@ fork(void)
     if(proc->ofile[i])
       np->ofile[i] = filedup(proc->ofile[i]);
   np->cwd = idup(proc->cwd);
+  vmadup(np->vma, np->nvma);
  
   pid = np->pid;
   np->state = RUNNABLE;
@@ -167,6 +199,7 @@ void
 exit(void)
 {
   struct proc *p;
+  struct vma *v;
   int fd;
 
   if(proc == initproc)
@@ -182,6 +215,14 @@ exit(void)
 
   iput(proc->cwd);
   proc->cwd = 0;
+  // Unmap shared file areas now rather than in wait, so
+  // that a removed file's frames are unmapped by the time
+  // vmaput drops its last reference (see shareinval).
+  mmapflush();
+  for(v = proc->vma; v < &proc->vma[proc->nvma]; v++)
+    if(v->type == VMA_SHARED)
+      deallocuvm(proc->pgdir, v->end, v->start);
+  vmaput(proc->vma, proc->nvma);
 
   acquire(&ptable.lock);
 
@@ -224,7 +265,8 @@ wait(void)
         pid = p->pid;
         kfree(p->kstack,0,0);
         p->kstack = 0;
-        freevm(p->pgdir);
+        freevm(p->pgdir, p->vma, p->nvma);
+        p->nvma = 0;
         p->state = UNUSED;
         p->pid = 0;
         p->parent = 0;
@@ -277,6 +319,7 @@ scheduler(void)
       p->state = RUNNING;
       swtch(&cpu->scheduler, proc->context);
       switchkvm();
+      cpu->pgdir = 0;
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
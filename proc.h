@@ -10,6 +10,10 @@ struct cpu {
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
+  void *freepages;             // Free pages cached by kalloc.c
+  int nfreepages;              // Number of pages in freepages
+  pde_t *pgdir;                // User page table loaded, or 0
+  volatile int tlbwant;        // tlbshootdown is waiting for us
   
   // Cpu-local storage variables; see below
   struct cpu *cpu;
@@ -51,6 +55,26 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A virtual memory area: a page-aligned range of user memory
+// and what backs it.  Its pages are filled in on first touch
+// (see loadpage in vm.c); see also vma.c.
+struct vma {
+  uint start;                  // First address
+  uint end;                    // Address just past the area
+  int type;                    // VMA_ANON, VMA_FILE, ...
+  int prot;                    // PTE_W if writable
+  struct inode *ip;            // VMA_FILE, VMA_SHARED: file backing it
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes read from the file;
+                               //   the rest is zero filled
+  int advice;                  // MADV_NORMAL or MADV_SEQUENTIAL
+};
+
+#define VMA_ANON   1           // Zero filled: bss, heap
+#define VMA_FILE   2           // Program text and data, MAP_PRIVATE
+#define VMA_STACK  3           // User stack and its guard page
+#define VMA_SHARED 4           // MAP_SHARED: written back to the file
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -65,6 +89,11 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // User memory, sorted by address
+  int nvma;                    // Number of entries in vma[]
+  uint pinstart[NPIN];         // Ranges of pages populate pinned
+  uint pinend[NPIN];           // for the current system call
+  int npin;                    // Number of them
   char name[16];               // Process name (debugging)
 };
 
@@ -73,3 +102,6 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+// The areas in vma[] cover [0, sz) without holes.  Areas
+// above sz are files mapped by mmap, placed as high below
+// KERNBASE as they fit; the heap can't grow into them.
@@ -0,0 +1,347 @@
+// Shared cache of MAP_SHARED file pages.
+//
+// Every process that maps a page of a file MAP_SHARED maps
+// the same frame, found here by inode and file offset, so
+// stores through any of the mappings land in one copy, which
+// mmapflush writes back to the file.  writei copies what it
+// writes into the cached frames too, so writing a frame back
+// can't undo a write; read sees stores through the mappings
+// once they have been written back.
+//
+// As in text.c, the cache keeps each frame alive with a
+// mapping of its own, a PTE in its entry that no page table
+// holds, which owns the frame; the processes' mappings are on
+// its rmap.  A frame some process maps is never evicted
+// (policy.c), since each mapping would read back a copy of
+// its own.  Mappings are written back before they are removed
+// (munmap, madvise, exec, exit), so a frame only the cache
+// maps is clean, and eviction just drops it (shareevict).
+//
+// Entries come from a slab cache, so how many pages can be
+// cached is only limited by memory.  share.lock protects the
+// hash chains, and is taken before page locks.  An entry's
+// PTE also changes with only its frame's lock held, when
+// shareevict empties it, so a frame found here is checked
+// again once it is locked, and empty entries are freed
+// later: by lookups on their chain, and by a sweep of every
+// chain whenever the number of entries has doubled.
+// loadpage holds the inode lock around looking a page up
+// and adding it, so a page is only read once.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "file.h"
+#include "page.h"
+#include "slab.h"
+
+#define NSHAREHASH 61
+
+struct shpage {
+  uint dev;
+  uint inum;
+  uint off;                    // File offset of the page
+  pte_t pte;                   // The cache's mapping of it, or 0
+  struct shpage *next;         // In its hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache;     // Of struct shpage
+  struct shpage *hash[NSHAREHASH];  // Chains by inode and offset
+  uint ninode[NSHAREHASH];     // Linked entries by inode
+  uint nentry;                 // Linked entries
+  uint nsweep;                 // Sweep when nentry reaches this
+  uint nhit, nmiss, nevict;
+} share;
+
+void
+shareinit(void)
+{
+  initlock(&share.lock, "share");
+  kmem_cache_init(&share.cache, "share", sizeof(struct shpage));
+  share.nsweep = NSHAREHASH;
+}
+
+static uint
+inodehash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NSHAREHASH;
+}
+
+static uint
+pagehash(uint dev, uint inum, uint off)
+{
+  return (dev * 31 + inum * 61 + off / PGSIZE) % NSHAREHASH;
+}
+
+// Free e, taken off its chain.  Caller holds share.lock.
+static void
+sharefree(struct shpage *e)
+{
+  share.ninode[inodehash(e->dev, e->inum)]--;
+  share.nentry--;
+  kmem_cache_free(&share.cache, e);
+}
+
+// Return the entry for the page at off in the inode dev,
+// inum, or 0, unlinking empty entries on the way.  Caller
+// holds share.lock.
+static struct shpage*
+sharefind(uint dev, uint inum, uint off)
+{
+  struct shpage **pp, *e;
+
+  pp = &share.hash[pagehash(dev, inum, off)];
+  while((e = *pp) != 0){
+    if(e->pte == 0){
+      *pp = e->next;
+      sharefree(e);
+      continue;
+    }
+    if(e->dev == dev && e->inum == inum && e->off == off)
+      return e;
+    pp = &e->next;
+  }
+  return 0;
+}
+
+// Lock the frame of e and return it, or return 0 if e is
+// empty.  Caller holds share.lock.
+static char*
+lockentry(struct shpage *e)
+{
+  pte_t pte;
+  char *mem;
+
+  pte = e->pte;
+  if(!(pte & PTE_P))
+    return 0;
+  mem = p2v(PTE_ADDR(pte));
+  lockpage(mem);
+  if(e->pte != pte){
+    unlockpage(mem);  // shareevict emptied it meanwhile
+    return 0;
+  }
+  return mem;
+}
+
+// Empty e if nobody but the cache maps its frame, and
+// return the frame for the caller to kfree once it has let
+// go of share.lock, else 0.  Caller holds share.lock.
+static char*
+sharedrop(struct shpage *e)
+{
+  char *mem;
+
+  if((mem = lockentry(e)) == 0)
+    return 0;
+  if(krefs(mem) > 1){
+    unlockpage(mem);
+    return 0;
+  }
+  disown(mem);
+  scnoderemove(mem);
+  PAGE(mem)->flags &= ~PG_SHARED;
+  e->pte = 0;
+  unlockpage(mem);
+  return mem;
+}
+
+// Free the empty entries.  Caller holds share.lock.
+static void
+sharesweep(void)
+{
+  struct shpage **pp, *e;
+  int h;
+
+  for(h = 0; h < NSHAREHASH; h++){
+    pp = &share.hash[h];
+    while((e = *pp) != 0){
+      if(e->pte == 0){
+        *pp = e->next;
+        sharefree(e);
+      } else
+        pp = &e->next;
+    }
+  }
+}
+
+// Return the cached frame holding the page at off in ip,
+// locked, or 0.  Caller holds ip's lock.
+char*
+sharelookup(struct inode *ip, uint off)
+{
+  struct shpage *e;
+  char *mem;
+
+  acquire(&share.lock);
+  mem = 0;
+  if((e = sharefind(ip->dev, ip->inum, off)) != 0)
+    mem = lockentry(e);
+  if(mem)
+    share.nhit++;
+  else
+    share.nmiss++;
+  release(&share.lock);
+  return mem;
+}
+
+// Cache mem, a frame nobody maps yet holding the page at off
+// in ip, as sharelookup would return it: the cache's mapping
+// owns it, and it is returned locked.  Returns -1 if out of
+// memory.  Caller holds ip's lock, and found no frame for
+// the page.
+int
+shareadd(struct inode *ip, uint off, char *mem)
+{
+  struct shpage *e;
+  uint h;
+
+  if((e = kmem_cache_alloc(&share.cache)) == 0)
+    return -1;
+  acquire(&share.lock);
+  if(share.nentry >= share.nsweep){
+    sharesweep();
+    share.nsweep = 2*share.nentry + NSHAREHASH;
+  }
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  h = pagehash(ip->dev, ip->inum, off);
+  e->next = share.hash[h];
+  share.hash[h] = e;
+  share.ninode[inodehash(ip->dev, ip->inum)]++;
+  share.nentry++;
+  lockpage(mem);
+  PAGE(mem)->flags |= PG_SHARED;
+  e->pte = v2p(mem) | PTE_P;
+  own(mem, &e->pte);
+  scnodeenqueue(mem);
+  release(&share.lock);
+  return 0;
+}
+
+// If the page at pg, chosen for eviction, is a cached frame,
+// which only the cache can map then, drop it from the cache
+// and return 1.  Caller holds its lock.
+int
+shareevict(char *pg)
+{
+  struct page *p;
+  pte_t *pte;
+
+  p = PAGE(pg);
+  if(!(p->flags & PG_SHARED))
+    return 0;
+  if(p->refs != 1)
+    panic("shareevict");
+  pte = p->owner;
+  disown(pg);
+  p->flags &= ~PG_SHARED;
+  *pte = 0;
+  share.nevict++;
+  return 1;
+}
+
+// If the cached frame at pg has been written through any
+// mapping since it was last written back, mark all of them
+// clean and return 1.  Caller holds its lock, and must
+// tlbshootdown before writing it back.
+int
+shareclean(char *pg)
+{
+  struct rmap *r;
+  int dirty;
+
+  dirty = 0;
+  for(r = PAGE(pg)->rmap; r; r = r->next){
+    if(*r->pte & PTE_D){
+      *r->pte &= ~PTE_D;
+      tlbflushpte(r->pte);
+      dirty = 1;
+    }
+  }
+  return dirty;
+}
+
+// writei has stored the n bytes at from, which it got from
+// src, at off in ip.  Store them in the cached frame too,
+// unless src is that frame being written back.  The n bytes
+// are all in one page.  Caller holds ip's lock.  shareadd
+// also runs with it held, so ninode can be looked at without
+// share.lock: another inode's pages only make us search for
+// nothing.
+void
+sharewrite(struct inode *ip, uint off, char *from, char *src, uint n)
+{
+  struct shpage *e;
+  char *mem, *to;
+
+  if(share.ninode[inodehash(ip->dev, ip->inum)] == 0)
+    return;
+  acquire(&share.lock);
+  if((e = sharefind(ip->dev, ip->inum, PGROUNDDOWN(off))) != 0 &&
+     (mem = lockentry(e)) != 0){
+    to = mem + off % PGSIZE;
+    if(to != src)
+      memmove(to, from, n);
+    unlockpage(mem);
+  }
+  release(&share.lock);
+}
+
+// Drop ip's frames; it is being freed, so nobody maps them.
+// Caller holds ip's lock.
+void
+shareinval(struct inode *ip)
+{
+  struct shpage *e;
+  char *mem;
+  int h;
+
+  if(share.ninode[inodehash(ip->dev, ip->inum)] == 0)
+    return;
+  h = 0;
+  while(h < NSHAREHASH){
+    mem = 0;
+    acquire(&share.lock);
+    for(; h < NSHAREHASH && mem == 0; h++){
+      for(e = share.hash[h]; e; e = e->next){
+        if(e->dev != ip->dev || e->inum != ip->inum || e->pte == 0)
+          continue;
+        if((mem = sharedrop(e)) == 0 && e->pte != 0)
+          panic("shareinval");
+        if(mem){
+          h--;  // look at the rest of the chain again
+          break;
+        }
+      }
+    }
+    release(&share.lock);
+    if(mem)
+      kfree(mem, 0, 0);
+  }
+}
+
+// Print cache usage.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+sharedump(void)
+{
+  struct shpage *e;
+  int h, n;
+
+  n = 0;
+  for(h = 0; h < NSHAREHASH; h++)
+    for(e = share.hash[h]; e; e = e->next)
+      if(e->pte & PTE_P)
+        n++;
+  cprintf("share: %d pages cached; %d hits, %d misses, %d evicted\n",
+          n, share.nhit, share.nmiss, share.nevict);
+}
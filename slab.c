@@ -0,0 +1,204 @@
+// Slab allocator for kernel objects much smaller than a page,
+// such as pipes, open files and in-memory inodes.
+//
+// Each kmem_cache hands out objects of one size. Objects are
+// carved out of slabs, single pages from kalloc with a struct
+// slab header at the start, so an object's slab is found by
+// rounding its address down to a page. As in kalloc.c, each
+// cpu keeps a few free objects of every cache, so the cache
+// lock is only taken to move SLABBATCH objects at a time.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "slab.h"
+
+#define SLABBATCH 8
+
+struct slab {
+  struct slab *next;           // On the cache's partial list
+  struct slab *prev;
+  void *free;                  // Free objects in this slab
+  uint inuse;                  // Objects not on free
+};
+
+struct obj {
+  struct obj *next;
+};
+
+static struct kmem_cache *caches;
+
+// Set up c to hand out objects of size bytes.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 3) & ~3;
+  if(c->size < sizeof(struct obj))
+    c->size = sizeof(struct obj);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  if(c->perslab == 0)
+    panic("kmem_cache_init: object too big");
+  c->partial = 0;
+  c->nslabs = 0;
+  c->nobjs = 0;
+  c->noevict = 0;
+  c->next = caches;
+  caches = c;
+}
+
+static void
+unlinkslab(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+linkslab(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Move up to SLABBATCH objects from c's slabs to this cpu.
+// Interrupts must be off.  Returns 0 if out of memory.
+static int
+refill(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *page;
+  int i, id;
+
+  id = cpu - cpus;
+  acquire(&c->lock);
+  if(c->partial == 0){
+    // kalloc may evict a page, polling the disk since
+    // interrupts are off, so don't keep other cpus out of
+    // c meanwhile.
+    release(&c->lock);
+    page = c->noevict ? kalloc_noevict() : kalloc(0);
+    if(page == 0)
+      return 0;
+    s = (struct slab*)page;
+    s->inuse = 0;
+    s->free = 0;
+    for(i = c->perslab - 1; i >= 0; i--){
+      o = (struct obj*)(page + sizeof(struct slab) + i*c->size);
+      o->next = s->free;
+      s->free = o;
+    }
+    acquire(&c->lock);
+    linkslab(c, s);
+    c->nslabs++;
+  }
+  while(c->percpu[id].n < SLABBATCH && (s = c->partial) != 0){
+    o = s->free;
+    s->free = o->next;
+    s->inuse++;
+    c->nobjs++;
+    if(s->free == 0)
+      unlinkslab(c, s);  // full slabs are on no list
+    o->next = c->percpu[id].free;
+    c->percpu[id].free = o;
+    c->percpu[id].n++;
+  }
+  release(&c->lock);
+  return 1;
+}
+
+// Give SLABBATCH objects cached by this cpu back to their
+// slabs, freeing slabs that end up empty.
+// Interrupts must be off.
+static void
+drain(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  int i, id;
+
+  id = cpu - cpus;
+  acquire(&c->lock);
+  for(i = 0; i < SLABBATCH && (o = c->percpu[id].free) != 0; i++){
+    c->percpu[id].free = o->next;
+    c->percpu[id].n--;
+    s = (struct slab*)PGROUNDDOWN((uint)o);
+    if(s->free == 0)
+      linkslab(c, s);
+    o->next = s->free;
+    s->free = o;
+    s->inuse--;
+    c->nobjs--;
+    if(s->inuse == 0){
+      unlinkslab(c, s);
+      c->nslabs--;
+      kfree((char*)s, 0, 0);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate one object from c.  Its contents are garbage.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct obj *o;
+  int id;
+
+  pushcli();
+  id = cpu - cpus;
+  if(c->percpu[id].n == 0 && !refill(c)){
+    popcli();
+    return 0;
+  }
+  o = c->percpu[id].free;
+  c->percpu[id].free = o->next;
+  c->percpu[id].n--;
+  popcli();
+  return o;
+}
+
+// Free an object returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *v)
+{
+  struct obj *o;
+  int id;
+
+  o = (struct obj*)v;
+  pushcli();
+  id = cpu - cpus;
+  o->next = c->percpu[id].free;
+  c->percpu[id].free = o;
+  if(++c->percpu[id].n >= 2*SLABBATCH)
+    drain(c);
+  popcli();
+}
+
+// Print object and slab counts of every cache.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+
+  for(c = caches; c; c = c->next)
+    cprintf("slab %s: %d bytes, %d out of slabs, %d slabs of %d\n",
+            c->name, c->size, c->nobjs, c->nslabs, c->perslab);
+}
@@ -0,0 +1,17 @@
+// Cache of equally sized kernel objects, carved out of
+// kalloc pages; see slab.c.
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;                  // For slabdump
+  uint size;                   // Object size, rounded up to 4 bytes
+  uint perslab;                // Objects per slab page
+  struct slab *partial;        // Slabs with free objects
+  uint nslabs;                 // Slab pages allocated
+  uint nobjs;                  // Objects handed out of slabs
+  int noevict;                 // Refill without evicting pages
+  struct {
+    void *free;                // Objects cached by this cpu
+    int n;
+  } percpu[NCPU];
+  struct kmem_cache *next;     // All caches, for slabdump
+};
@@ -31,8 +31,11 @@ acquire(struct spinlock *lk)
   // The xchg is atomic.
   // It also serializes, so that reads after acquire are not
   // reordered before it. 
+  // Interrupts are off, so do any TLB shootdown asked of
+  // this cpu while waiting; the lock holder may be the one
+  // waiting for it.
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    tlbpoll();
 
   // Record info about lock acquisition for debugging.
   lk->cpu = cpu;
@@ -7,93 +7,128 @@
 #include "x86.h"
 #include "proc.h"
 #include "swap.h"
+#include "page.h"
 #include "spinlock.h"
+#include "buf.h"
+#include "mman.h"
 
-/*  Sentinel nodes pointing to beginning and end of the
-		second chance queue of evict-candidate pages. */
-static struct scnode schead;
-static struct scnode sctail;
-static struct scnode nodememory[MEMORYPGCAPACITY];
+/*  Evictable pages are linked through their struct pages
+		in whatever order the replacement policy (policy.c)
+		likes. */
 static struct spinlock sclock;
+static struct swappolicy* policy;
 
-/*  Parallel to kmem.freelist for keeping track of free
-		pages on the swap drive */
-static struct freeswapnode* swaphead;
-static struct freeswapnode swapmemory[SWAPPGCAPACITY];
+/*  Orders swap I/O: a process reading a page back in from
+		a slot must queue its read after the write that put it
+		there. swappage holds swapiolock from unmapping pages
+		until their write is queued, and unswappage takes it
+		to queue its read. Also serializes the compressed
+		pool's stores, loads and writebacks (zswap.c). */
+static struct spinlock swapiolock;
+static uint nresident; // Pages the policy holds
+
+// For comparing policies: pages evicted and read back.
+static uint nevicted, nswapin, nclean;
+
+/*  kswapd sleeps on kswapdidle while memory is plentiful.
+		kalloc wakes it below FREELOW free pages. */
+static struct spinlock kswapdlock;
+static int kswapdidle;
+
+/*  Swap slot allocator. A bitmap with a bit set for
+		each slot in use, and a count of the PTEs pointing
+		at each slot. Both are sized from the swap disk at
+		boot. Slots are handed out next-fit from swaprover,
+		so consecutive evictions land next to each other. */
+static uint* swapmap;
+static uchar* swaprefs;
+static uint nswapslots;
+static uint swaprover;
 static struct spinlock freeswaplock;
 
 void
 swapinit() {
+	uint bytes;
+	int order;
+
 	// Setup disk free structure
-	struct freeswapnode* curr;
-	struct freeswapnode* next;
-	int i;
-	swaphead = &(swapmemory[0]);
-	curr = swaphead;
-	for (i = 1; i < SWAPPGCAPACITY; i++) {
-		curr->index = i - 1;
-		next = &(swapmemory[i]);
-		curr->next = next;
-		curr = next;
-	}
-	curr->next = 0;
-	curr->index = i-1;
-
-	// Setup second chance queue
-	schead.next = &sctail;
-	sctail.prev = &schead;
+	nswapslots = idesize(SWAPDEV) / (PGSIZE / BSIZE);
+	if (nswapslots > MAXSWAPSLOTS) {
+		nswapslots = MAXSWAPSLOTS;
+	}
+	if (nswapslots) {
+		bytes = (nswapslots + 31) / 32 * 4 + nswapslots;
+		for (order = 0; (PGSIZE << order) < bytes; order++)
+			;
+		swapmap = (uint*)kalloc_order(order);
+		if (!swapmap) {
+			panic("swapinit: no memory for swap map");
+		}
+		memset(swapmap, 0, PGSIZE << order);
+		swaprefs = (uchar*)(swapmap + (nswapslots + 31) / 32);
+	}
+	cprintf("swap: %d slots\n", nswapslots);
+	zswapinit(nswapslots);
+
+	// Setup replacement policy
+	policy = policyinit(SWAPPOLICY);
+	cprintf("swap: %s replacement\n", policy->name);
 
 	// Initialize locks
 	initlock(&sclock, "scqueue");
+	initlock(&swapiolock, "swapio");
 	initlock(&freeswaplock,"freeswap");
+	initlock(&kswapdlock, "kswapd");
 	
 
 }
 
-// isreferenced and setunreferenced are called
-// with sclock held in choosepageforeviction.
-//	Check if accessed
-int isreferenced(uint idx) {
-	return *(owner[idx]) & PTE_A;
-}
-
-//	Unset accessed bit.
-void setunreferenced(uint idx) {
-	*(owner[idx]) &= ~(PTE_A);
-}
-
-//	Check scqueue (second chance queue) for a page to evict.
+//	Ask the replacement policy for a page to evict, and
+//	return it locked. Returns 0 if every page has been
+//	referenced too recently or is busy.
 char*
 choosepageforeviction(void) {
+	struct page* curr;
 	acquire(&sclock);
-	struct scnode* curr = schead.next;
-	if (!curr || curr == &sctail) {
+	if (nresident == 0) {
 		panic("no pages to evict!");
 	}
-	while (isreferenced(curr->index)) {
-		setunreferenced(curr->index);
-		//unlink from head
-		schead.next = curr->next;
-		curr->next->prev = &schead;
-		//link to end
-		(sctail.prev)->next = curr;
-		curr->next = &sctail;
-		curr->prev = sctail.prev;
-		sctail.prev = curr;
-		curr = schead.next;
+	if ((curr = policy->choose(nresident)) != 0) {
+		policy->remove(curr);
+		nresident--;
 	}
+	release(&sclock);
+	if (!curr) {
+		return 0;
+	}
+	//cprintf("Evict 0x%x\n",curr->owner);
+	return PAGEVA(curr); // Returns address in kernel space
+}
 
-	schead.next = curr->next;
-	curr->next->prev = &schead;
+// The frame at va is being freed; forget its swap slot.
+// Caller holds the page's lock.
+void
+swapuncache(char* va) {
+	struct page* pg = PAGE(va);
+	if (pg->swapslot) {
+		freeswapfree(pg->swapslot - 1);
+		pg->swapslot = 0;
+	}
+}
 
-	curr->next = 0;
-	curr->prev = 0;
+// Let the policy look at reference bits; called by cpu 0
+// on every timer tick.
+void
+swaptick(void) {
+	if (!policy || !policy->tick || ticks % AGETICKS != 0) {
+		return;
+	}
+	acquire(&sclock);
+	policy->tick();
 	release(&sclock);
-	//cprintf("Evict 0x%x\n",owner[curr->index]);
-	return p2v(curr->index * PGSIZE); // Returns address in kernel space
 }
 
-//	Adds evict candidates to back of queue.
+//	Hands an evict candidate to the policy.
 void
 scnodeenqueue(void* va) {
 
@@ -102,18 +137,12 @@ scnodeenqueue(void* va) {
 	if (idx <0 || idx >= MEMORYPGCAPACITY) {
 		panic("scnodenequeue invalid slot idx");
 	}
-	struct scnode* slot = &(nodememory[idx]);
+	struct page* slot = &pages[idx];
 	if (slot->next || slot->prev) {
 		panic("scnodeenqueue of existing page");
 	}
-	if (slot->index != 0 && idx != slot->index) {
-		panic("scnodeenqueue invalid slot->index");
-	}
-	slot->index = idx;
-	(sctail.prev)->next = slot;
-	slot->next = &sctail;
-	slot->prev = sctail.prev;
-	sctail.prev = slot;
+	policy->insert(slot);
+	nresident++;
 	release(&sclock);
 }
 
@@ -129,131 +158,516 @@ scnoderemove(void* va) {
 	if (idx <0 || idx >= MEMORYPGCAPACITY) {
 		panic("scnodenequeue invalid slot idx");
 	}
-	struct scnode* slot = &(nodememory[idx]);
-	struct scnode* prev = slot->prev;
-	struct scnode* next = slot->next;
-	if (!next || !prev) {
+	struct page* slot = &pages[idx];
+	if (!slot->next || !slot->prev) {
 		panic("scnoderemove of non present node");
 	}
-	prev->next = next;
-	next->prev = prev;
-	slot->next = 0;
-	slot->prev = 0;
+	policy->remove(slot);
+	nresident--;
+	release(&sclock);
+}
+
+//	Make an evictable page the next one to go, if the
+//	policy holds it. Caller holds the page's lock, and
+//	has cleared its accessed bits.
+void
+scnodecold(void* va) {
+	struct page* pg = PAGE(va);
+
+	acquire(&sclock);
+	if (pg->next) {
+		policy->cold(pg);
+	}
 	release(&sclock);
 }
 
-// Add node at index back to the freelist.
+#define SLOTUSED(i) (swapmap[(i)/32] & (1 << ((i)%32)))
+
+// Drop a reference to the slot at index, marking it
+// free once no PTE points at it.
 void
 freeswapfree(uint index) {
 	acquire(&freeswaplock);
-	struct freeswapnode* node;
-	node = &(swapmemory[index]);
-	if (index < 0 || index >= SWAPPGCAPACITY) {
+	if (index >= nswapslots) {
 		panic("Invalid swap index");
 	}
-	if (node->next) {
-		panic("freeswapfree of already free node");
+	if (!SLOTUSED(index)) {
+		panic("freeswapfree of already free slot");
+	}
+	if (--swaprefs[index] == 0) {
+		zswapdrop(index);
+		swapmap[index/32] &= ~(1 << (index%32));
 	}
-	node->next = swaphead;
-	swaphead = node;
-	
 	release(&freeswaplock);
 }
 
-// Grab a free spot in swap.
-struct freeswapnode*
-getfreenode() {
+// Another PTE now points at the swapped page at index (fork).
+void
+freeswapdup(uint index) {
 	acquire(&freeswaplock);
-	if (!swaphead) {
-		//Out of swap pages
+	if (index >= nswapslots || !SLOTUSED(index)) {
+		panic("Invalid swap index");
+	}
+	if (++swaprefs[index] == 0) {
+		panic("freeswapdup: too many references");
+	}
+	release(&freeswaplock);
+}
+
+/*
+	Grab a run of up to want consecutive free slots, each
+	with one reference. Takes the first run of want slots
+	after swaprover, or the longest shorter run if there
+	is none. Returns the first slot and sets *got to the
+	length, or returns -1 if swap is full.
+*/
+int
+swapalloc(int want, int* got) {
+	uint i, start, len, best, bestlen, n;
+
+	acquire(&freeswaplock);
+	best = bestlen = 0;
+	len = start = 0;
+	for (n = 0; n < nswapslots; n++) {
+		i = (swaprover + n) % nswapslots;
+		if (i == 0) {
+			len = 0; // Runs don't wrap around the end
+		}
+		if (i % 32 == 0 && swapmap[i/32] == ~0) {
+			len = 0;
+			n += 31; // Skip a word of used slots at once
+			continue;
+		}
+		if (SLOTUSED(i)) {
+			len = 0;
+			continue;
+		}
+		if (len++ == 0) {
+			start = i;
+		}
+		if (len > bestlen) {
+			best = start;
+			bestlen = len;
+		}
+		if (len == want) {
+			break;
+		}
+	}
+	if (bestlen == 0) {
 		release(&freeswaplock);
-		return 0;
+		return -1;
 	}
-	
-	struct freeswapnode* node = swaphead;
-	swaphead = swaphead->next;
-	node->next = 0;
+	for (i = best; i < best + bestlen; i++) {
+		swapmap[i/32] |= 1 << (i%32);
+		swaprefs[i] = 1;
+	}
+	swaprover = (best + bestlen) % nswapslots;
 	release(&freeswaplock);
-	return node;
+	*got = bestlen;
+	return best;
+}
+
+// Print how free swap is split up.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+swapdump(void) {
+	uint i, nfree, extents, len, largest;
+
+	nfree = extents = len = largest = 0;
+	for (i = 0; i < nswapslots; i++) {
+		if (SLOTUSED(i)) {
+			len = 0;
+			continue;
+		}
+		nfree++;
+		if (len++ == 0) {
+			extents++;
+		}
+		if (len > largest) {
+			largest = len;
+		}
+	}
+	cprintf("swap: %d of %d slots free in %d extents, largest %d\n",
+		nfree, nswapslots, extents, largest);
+	cprintf("swap: %s replacement, %d pages evicted (%d clean), %d swapped in\n",
+		policy->name, nevicted, nclean, nswapin);
+}
+
+// Is the PTE n after pte in the same page table, and
+// swapped to the slot n after slot?
+static int
+swapneighbour(pte_t* pte, int n, uint slot) {
+	pte_t* p = pte + n;
+	return PGROUNDDOWN((uint)p) == PGROUNDDOWN((uint)pte) &&
+		PTE_ONDISK(*p) && ((uint)*p >> 12) == slot + n;
 }
 
 /*
 	Check if the page is in memory, 
 	Else read it back to memory.
 
-	Ownerlock should be called. 
+	Must not be called with a page locked, since
+	kalloc may have to evict one. Only the
+	process owning pte may call this. Sleeps until
+	the page arrives unless a spinlock is held.
+
+	Reads ahead up to max-1 (at most SWAPCLUSTER-1)
+	following pages that were swapped out next to this
+	one, in the same transfer. They are mapped with the
+	accessed bit clear, so they are evicted first if they
+	turn out unneeded.
 */
 int 
-unswappage(pte_t* pte) {
+unswappage(pte_t* pte, int max) {
+	struct idereq r;
+	char* pgs[SWAPCLUSTER];
+	uint diskidx, flags;
+	int i, n, disk;
+
 	if (!PTE_ONDISK(*pte)) {
 		return 1;
 	}
-	char* newmem = kalloc(1);
-	if (!newmem) {
+	// Get the frames first; kalloc may sleep evicting.
+	diskidx = ((uint)*pte) >> 12;
+	if (max > SWAPCLUSTER) {
+		max = SWAPCLUSTER;
+	}
+	for (n = 0; n < max; n++) {
+		if (n > 0 && !swapneighbour(pte, n, diskidx)) {
+			break;
+		}
+		if (!(pgs[n] = kalloc(0))) {
+			break;
+		}
+	}
+	if (n == 0) {
 		return 0;
 	}
-	uint diskidx = ((uint)*pte) >> 12;
-	uint flags = ((uint)*pte) & 0xFFF;
-	flags |= PTE_P;
-	flags &= ~PTE_AVAIL;
-	readpg(newmem, diskidx * PGSIZE / BSIZE);
-	*pte = flags | v2p(newmem);
-	own(newmem, pte);
+	// swappage queues the write of these slots under swapiolock,
+	// so taking it orders our read after that write.
+	// Pages in the compressed pool need no disk I/O, and
+	// aren't worth reading ahead around.
+	acquire(&swapiolock);
+	disk = !zswapload(diskidx, pgs[0]);
+	for (i = 1; disk && i < n && swapneighbour(pte, i, diskidx) &&
+			!zswaphas(diskidx + i); i++)
+		;
+	if (disk) {
+		swapstart(&r, pgs, i, diskidx * PGSIZE / BSIZE, 0);
+	}
+	nswapin++;
+	release(&swapiolock);
+	for (; n > i; n--) {
+		kfree(pgs[n-1], 0, 0);
+	}
+	if (disk) {
+		swapwait(&r);
+	}
+	for (i = 0; i < n; i++) {
+		flags = ((uint)pte[i]) & 0xFFF;
+		flags |= PTE_P;
+		flags &= ~(PTE_AVAIL|PTE_D);
+		if (i > 0) {
+			flags &= ~PTE_A;
+		}
+		lockpage(pgs[i]);
+		pte[i] = flags | v2p(pgs[i]);
+		own(pgs[i], &pte[i]);
+		scnodeenqueue(pgs[i]);
+		if (disk) {
+			PAGE(pgs[i])->swapslot = diskidx + i + 1;
+		}
+		unlockpage(pgs[i]);
+	}
+	if (!disk) {
+		// Recompressing is cheap, so don't hold on to pool memory.
+		freeswapfree(diskidx); // Slot may still be shared with a forked process
+	}
 	return 1;
 }
 
+// Point pte at swap slot instead of a frame, in one store,
+// since other cpus look at PTEs without the page's lock.
+static void
+pteswapped(pte_t* pte, uint slot) {
+	*pte = (*pte & 0xFFF & ~PTE_P) | PTE_AVAIL | (slot<<12);
+	tlbflushpte(pte);
+}
+
+// Point every PTE mapping the page at pg at slot, taking a
+// reference to the slot for each beyond the first, and
+// forget the mappings. Caller holds the page's lock.
+static void
+unmappage(char* pg, uint slot) {
+	struct rmap* r;
+
+	pteswapped(PAGE(pg)->owner, slot);
+	for (r = PAGE(pg)->rmap; r; r = r->next) {
+		freeswapdup(slot);
+		pteswapped(r->pte, slot);
+	}
+	disown(pg);
+}
+
+// Has the page been written through any of its mappings?
+// Caller holds the page's lock.
+static int
+isdirty(struct page* p) {
+	struct rmap* r;
+
+	if (*p->owner & PTE_D) {
+		return 1;
+	}
+	for (r = p->rmap; r; r = r->next) {
+		if (*r->pte & PTE_D) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
 	Get a free page in memory, evict if necessary. 
+	Must not be called with a page locked. The victim is
+	chosen locked; its PTEs are pointed at swap, flushed
+	from every cpu's TLB and the write queued together
+	under swapiolock; the frame is
+	only handed out once the write is done.
+
+	A page shared by several page tables is unmapped from
+	all of them, which then share the swap slot. Following
+	unshared pages in the victim's page table that are
+	evictable, unreferenced and not locked by anyone else
+	go out with it, to the next slots in the same
+	transfer, as far as swapalloc finds a run of free
+	slots. Their frames are freed afterwards.
+
+	If the victim compresses well it goes to the compressed
+	pool (zswap.c) alone instead, and the oldest page there
+	is written out through the victim's frame if the pool
+	is full.
 */
 char*
 swappage(void) {
-	char* toevict = choosepageforeviction();
-	if (!toevict) {
+	struct idereq r;
+	char* pgs[SWAPCLUSTER];
+	pte_t* owner;
+	pte_t* pte;
+	int first, got, i, n, slot, stored;
+
+	pgs[0] = choosepageforeviction();
+	if (!pgs[0]) {
 		return 0;
 	}
-	struct freeswapnode* node = getfreenode();
-	if (!node) {
-		scnodeenqueue(toevict); // The page is still in memory
+	//cprintf("Evicting page %p!\n",pgs[0]);
+	owner = PAGE(pgs[0])->owner;
+	if (owner == PG_UNOWNED) {
+		panic("Eviction of unowned page!");
+	}
+	if (textevict(pgs[0]) || shareevict(pgs[0])) {
+		// An executable's page, never written, or a shared
+		// file page already written back; the file has it.
+		tlbshootdown();
+		nevicted++;
+		nclean++;
+		unlockpage(pgs[0]);
+		return pgs[0];
+	}
+	if ((slot = PAGE(pgs[0])->swapslot) != 0) {
+		PAGE(pgs[0])->swapslot = 0;
+		if (!isdirty(PAGE(pgs[0]))) {
+			// Unchanged since it was read in; the slot still has it.
+			unmappage(pgs[0], slot - 1);
+			tlbshootdown();
+			nevicted++;
+			nclean++;
+			unlockpage(pgs[0]);
+			return pgs[0];
+		}
+		freeswapfree(slot - 1);
+	}
+	for (n = 1; n < SWAPCLUSTER && !PAGE(pgs[0])->rmap; n++) {
+		pte = owner + n;
+		if (PGROUNDDOWN((uint)pte) != PGROUNDDOWN((uint)owner) ||
+				(*pte & (PTE_P|PTE_A)) != PTE_P) {
+			break;
+		}
+		pgs[n] = p2v(PTE_ADDR(*pte));
+		if (pgs[n] == zeropg || !trylockpage(pgs[n])) {
+			break;
+		}
+		// Owned pages are always in the scqueue.
+		if ((*pte & (PTE_P|PTE_A)) != PTE_P || p2v(PTE_ADDR(*pte)) != pgs[n] ||
+				PAGE(pgs[n])->owner != pte || PAGE(pgs[n])->rmap ||
+				PAGE(pgs[n])->swapslot) {
+			unlockpage(pgs[n]);
+			break;
+		}
+	}
+	if ((first = swapalloc(n, &got)) < 0) {
+		got = 0;
+	}
+	for (; n > got && n > 1; n--) {
+		unlockpage(pgs[n-1]);
+	}
+	if (first < 0) {
+		scnodeenqueue(pgs[0]); // The page is still in memory
+		unlockpage(pgs[0]);
 		return 0;
 	}
-	//cprintf("Evicting page %p!\n",toevict);
-	uint ondiskindex = node->index;
-	uint oidx =v2p(toevict)/PGSIZE;
-	pte_t* pte = owner[oidx];
-	if (pte == PG_UNOWNED) {
-		panic("Eviction of unowned page!");
+	acquire(&swapiolock);
+	// Nobody may write to a page once its contents are taken.
+	unmappage(pgs[0], first);
+	tlbshootdown();
+	slot = -1;
+	if ((stored = zswapstore(first, pgs[0]))) {
+		for (i = 1; i < n; i++) {
+			freeswapfree(first + i);
+			unlockpage(pgs[i]);
+		}
+		n = 1;
 	}
-	writepg(toevict, ondiskindex * PGSIZE / BSIZE);
-	*pte &= 0xFFF;
-	*pte &= (~PTE_P);
-	*pte |= PTE_AVAIL;
-	*pte |= (ondiskindex<<12);
-	disown(toevict);
-	return toevict;
+	for (i = 1; i < n; i++) {
+		scnoderemove(pgs[i]);
+		unmappage(pgs[i], first + i);
+	}
+	tlbshootdown();
+	nevicted += n;
+	if (!stored) {
+		swapstart(&r, pgs, n, first * PGSIZE / BSIZE, 1);
+	}
+	else if ((slot = zswapevict(pgs[0])) >= 0) {
+		swapstart(&r, pgs, 1, slot * PGSIZE / BSIZE, 1);
+	}
+	release(&swapiolock);
+	// Disowned, so nobody else can reach the frames now.
+	for (i = 0; i < n; i++) {
+		unlockpage(pgs[i]);
+	}
+	if (!stored || slot >= 0) {
+		swapwait(&r);
+	}
+	for (i = 1; i < n; i++) {
+		kfree(pgs[i], 0, 0);
+	}
+	return pgs[0];
 }
 
 /*
-	Called from trap.c.
+	Page-out daemon, a kernel process started by main.
+	Once free memory drops below FREELOW pages it evicts
+	until FREEHIGH are free, so that kalloc rarely has to
+	evict, and wait for the swap disk, itself.
+*/
+void
+kswapd(void) {
+	char* pg;
+
+	acquire(&kswapdlock);
+	for (;;) {
+		while (kfreepages() >= FREELOW) {
+			kswapdidle = 1;
+			sleep(&kswapdidle, &kswapdlock);
+		}
+		kswapdidle = 0;
+		release(&kswapdlock);
+		pg = 0;
+		while (kfreepages() < FREEHIGH && (pg = swappage()) != 0) {
+			kfree(pg, 0, 0);
+		}
+		if (kfreepages() < FREEHIGH && !pg) {
+			// Nothing evictable right now (swap full, or all
+			// pages in use); try again on the next tick.
+			acquire(&tickslock);
+			sleep(&ticks, &tickslock);
+			release(&tickslock);
+		}
+		acquire(&kswapdlock);
+	}
+}
+
+// Called by kalloc when free memory is low.
+void
+kswapdwake(void) {
+	if (!kswapdidle) {
+		return; // Already running, or not started yet
+	}
+	acquire(&kswapdlock);
+	kswapdidle = 0;
+	wakeup(&kswapdidle);
+	release(&kswapdlock);
+}
+
+/*
+	A fault segflthandler couldn't fix (out of memory or swap)
+	kills a user process on its way back to user space. The
+	kernel can't take that way out: the faulting instruction
+	would only fault again, forever. System calls bring the
+	user memory they use in first (populate, prefault), so
+	this only happens if a page went again meanwhile.
+*/
+static void
+faultfailed(uint err) {
+	if (!(err & PTE_U)) {
+		panic("kernel page fault failed");
+	}
+	proc->killed = 1;
+}
+
+/*
+	Called from trap.c with the page fault error code.
 	Will write back a page to memory if the page's AVAIL bit
 	(which we arbitrarily designated as meaning "swapped") 
-	is set.
+	is set, load an untouched page from the executable or
+	zero fill it, or copy a page
+	shared copy-on-write by fork on a write to it.
+	In areas advised MADV_SEQUENTIAL, swap-ins read ahead
+	further and the page before goes to the eviction head,
+	since it won't be used again.
+	Returns 0 if the fault was not ours to handle.
 */
-void
-segflthandler(int user) {
-	uint cr2 = PGROUNDDOWN(rcr2());
+int
+segflthandler(uint err) {
+	uint va = PGROUNDDOWN(rcr2());
+	struct vma* v;
 	pte_t* pte;
-	if (user) {
-		pte = walkpgdir(proc->pgdir, (void*) cr2, 0);
+	int seq;
+	if (!proc || va >= KERNBASE) {
+		return 0;
 	}
-	else if (rcr2() < KERNBASE) {
-		pte = walkpgdir(proc->pgdir, (void*) cr2, 0);
+	v = vmafind(proc->vma, proc->nvma, va);
+	seq = v && v->advice == MADV_SEQUENTIAL && va > v->start;
+	pte = walkpgdir(proc->pgdir, (void*) va, 0);
+	if (!(err & PTE_P) && (!pte || !(*pte & (PTE_P|PTE_AVAIL))) && v) {
+		// Program text/data still in the executable, or heap
+		// reserved by sbrk, touched for the first time.
+		if (loadpage(proc, va, err & PTE_W) < 0) {
+			faultfailed(err);
+		} else if (seq) {
+			coldpage(proc->pgdir, va - PGSIZE);
+		}
+		return 1;
+	}
+	if (!pte) {
+		return 0;
 	}
-	if (pte && !(*pte & PTE_P) && (*pte & PTE_AVAIL)) {
-		if (!unswappage(pte)) {
-			proc->killed = 1;
+	if (!(err & PTE_P) && PTE_ONDISK(*pte)) {
+		if (!unswappage(pte, seq ? SWAPCLUSTER : SWAPREADAHEAD)) {
+			faultfailed(err);
+		} else if (seq) {
+			coldpage(proc->pgdir, va - PGSIZE);
 		}
+		return 1;
 	}
-	else {
-		panic("In segflthandler but wrong flags in owner or no pte");
+	if ((err & PTE_P) && (err & PTE_W) && (*pte & PTE_COW)) {
+		if ((err & PTE_U) && !(*pte & PTE_U)) {
+			return 0; // e.g. the stack guard page
+		}
+		if (cowpage(pte) < 0) {
+			faultfailed(err);
+		}
+		return 1;
 	}
+	return 0;
 }
@@ -1,16 +1,16 @@
-struct scnode {
-	struct scnode* next;
-	struct scnode* prev;
-	uint index; //Physical address (like v2p(kalloc())) divided by PGSIZE
-};
+struct page;
 
-struct freeswapnode {
-	struct freeswapnode* next;
-	uint index;
+// A page replacement policy; see policy.c.
+struct swappolicy {
+	char* name;
+	void (*insert)(struct page*);  // Page became evictable
+	void (*remove)(struct page*);  // Page is no longer evictable
+	void (*cold)(struct page*);    // Evict it before the others
+	struct page* (*choose)(uint);  // Pick one of n pages and lock it
+	void (*tick)(void);            // Every AGETICKS ticks, if set
 };
 
-#define SWAPPGCAPACITY (TOTALSWAPBYTES/PGSIZE)
-
-#define MEMORYPGCAPACITY (TOTALMAINBYTES/PGSIZE)
+#define AGETICKS 10
 
-#define PG_UNOWNED 0
\ No newline at end of file
+// Slot numbers live in PTE bits 12 and up.
+#define MAXSWAPSLOTS (1 << 20)
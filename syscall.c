@@ -17,7 +17,8 @@
 int
 fetchint(uint addr, int *ip)
 {
-  if(addr >= proc->sz || addr+4 > proc->sz)
+  if(!vmacovers(proc->vma, proc->nvma, addr, addr+4, 0) ||
+     prefault(proc, addr, 4) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -29,16 +30,21 @@ fetchint(uint addr, int *ip)
 int
 fetchstr(uint addr, char **pp)
 {
-  char *s, *ep;
+  struct vma *v;
+  char *s;
 
-  if(addr >= proc->sz)
+  if((v = vmafind(proc->vma, proc->nvma, addr)) == 0)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)proc->sz;
-  for(s = *pp; s < ep; s++)
+  for(s = *pp; ; s++){
+    if((uint)s >= v->end &&
+       (v = vmafind(proc->vma, proc->nvma, (uint)s)) == 0)
+      return -1;
+    if((s == *pp || (uint)s % PGSIZE == 0) && prefault(proc, (uint)s, 1) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
-  return -1;
+  }
 }
 
 // Fetch the nth 32-bit system call argument.
@@ -50,15 +56,20 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size n bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process's memory areas, writable ones if
+// write is set since the kernel will store to it, and pin
+// it in memory until the call returns (populate).
 int
-argptr(int n, char **pp, int size)
+argptr(int n, char **pp, int size, int write)
 {
   int i;
   
   if(argint(n, &i) < 0)
     return -1;
-  if((uint)i >= proc->sz || (uint)i+size > proc->sz)
+  if(size < 0 ||
+     !vmacovers(proc->vma, proc->nvma, i, (uint)i+size, write ? PTE_W : 0))
+    return -1;
+  if(populate(proc, i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -98,6 +109,9 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_madvise(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -121,6 +135,9 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_madvise] sys_madvise,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
 };
 
 void
@@ -131,6 +148,7 @@ syscall(void)
   num = proc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     proc->tf->eax = syscalls[num]();
+    unpopulate(proc);
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             proc->pid, proc->name, num);
@@ -0,0 +1,268 @@
+// Shared cache of executable pages.
+//
+// The pages loadpage reads from an executable are kept here,
+// keyed by inode, file offset and length, so that every
+// process running the same program maps the same frames
+// instead of reading its own copies.  They are mapped
+// read-only, or copy-on-write in writable areas, so a
+// process that writes one gets a private copy (cowpage).
+//
+// The cache keeps each page alive with a mapping of its own,
+// a PTE in pte[] that no page table holds, which goes on the
+// page's rmap like any other.  So a cached page stays after
+// the last process running the program exits, and eviction
+// sees it as one more shared page.  Since none of the
+// mappings can have written it, swappage drops a cached page
+// instead of writing it to swap (textevict), and the next
+// touch reads it from the file again.
+//
+// The table is direct mapped: a page whose slot is taken
+// replaces the page there.  Writing or truncating a file
+// drops its pages (textinval); ninode[] counts the slots
+// keyed to each bucket of inodes, so that writing a file
+// with no cached pages doesn't have to search the table.
+// text.lock protects the
+// table, and is taken before page locks.  A slot's PTE also
+// changes with only its page's lock held, when textevict
+// empties it, so a page found in the table is checked again
+// once it is locked.  loadpage holds the inode lock around
+// looking a page up and adding it, so a page is only read
+// once.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "file.h"
+#include "page.h"
+
+static struct {
+  struct spinlock lock;
+  pte_t pte[NTEXTPAGE];        // The cache's mapping of each page, or 0
+  struct {
+    uint dev;
+    uint inum;
+    uint off;                  // File offset of the page
+    uint n;                    // Bytes from the file; the rest is zero
+  } key[NTEXTPAGE];
+  uint ninode[NTEXTINODE];     // Keys whose inode hashes to each bucket
+  uint nhit, nmiss, ndrop;
+} text;
+
+void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+static uint
+inodehash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NTEXTINODE;
+}
+
+static uint
+texthash(struct inode *ip, uint off)
+{
+  return (ip->dev * 31 + ip->inum * 61 + off / PGSIZE) % NTEXTPAGE;
+}
+
+// Lock the page in slot i and return it, or return 0 if
+// the slot is empty.  Caller holds text.lock.
+static char*
+lockslot(int i)
+{
+  pte_t e;
+  char *mem;
+
+  e = text.pte[i];
+  if(!(e & PTE_P))
+    return 0;
+  mem = p2v(PTE_ADDR(e));
+  lockpage(mem);
+  if(text.pte[i] != e){
+    unlockpage(mem);  // textevict emptied it meanwhile
+    return 0;
+  }
+  return mem;
+}
+
+// Empty slot i.  If the cache held the last mapping of the
+// page, return it for the caller to kfree once it has let
+// go of text.lock, else 0.  Caller holds text.lock.
+static char*
+textdrop(int i)
+{
+  char *mem;
+
+  if((mem = lockslot(i)) == 0)
+    return 0;
+  text.ndrop++;
+  if(krefs(mem) > 1){
+    rmapdel(mem, &text.pte[i]);
+    text.pte[i] = 0;
+    unlockpage(mem);
+    return 0;
+  }
+  disown(mem);
+  scnoderemove(mem);
+  text.pte[i] = 0;
+  unlockpage(mem);
+  return mem;
+}
+
+// Return the cached page holding the n bytes at off in ip,
+// locked, or 0.  Caller holds ip's lock.
+char*
+textlookup(struct inode *ip, uint off, uint n)
+{
+  char *mem;
+  int i;
+
+  i = texthash(ip, off);
+  acquire(&text.lock);
+  mem = 0;
+  if(text.key[i].dev == ip->dev && text.key[i].inum == ip->inum &&
+     text.key[i].off == off && text.key[i].n == n)
+    mem = lockslot(i);
+  if(mem)
+    text.nhit++;
+  else
+    text.nmiss++;
+  release(&text.lock);
+  return mem;
+}
+
+// Cache mem, a page nobody maps yet holding the n bytes at
+// off in ip, as textlookup would return it: the cache's
+// mapping owns it, and it is returned locked.  Sets *old to
+// the page it replaced, if that must be kfreed, else 0.
+// Caller holds ip's lock.
+void
+textadd(struct inode *ip, uint off, uint n, char *mem, char **old)
+{
+  int i;
+
+  i = texthash(ip, off);
+  acquire(&text.lock);
+  *old = textdrop(i);
+  if(text.key[i].inum != 0)
+    text.ninode[inodehash(text.key[i].dev, text.key[i].inum)]--;
+  text.ninode[inodehash(ip->dev, ip->inum)]++;
+  text.key[i].dev = ip->dev;
+  text.key[i].inum = ip->inum;
+  text.key[i].off = off;
+  text.key[i].n = n;
+  lockpage(mem);
+  text.pte[i] = v2p(mem) | PTE_P;
+  own(mem, &text.pte[i]);
+  scnodeenqueue(mem);
+  release(&text.lock);
+}
+
+// Is pte one of the cache's own mappings?
+static int
+textpte(pte_t *pte)
+{
+  return pte >= &text.pte[0] && pte < &text.pte[NTEXTPAGE];
+}
+
+// The cache's mapping of page p, or 0 if it isn't cached.
+static pte_t*
+textmapping(struct page *p)
+{
+  struct rmap *r;
+
+  if(textpte(p->owner))
+    return p->owner;
+  for(r = p->rmap; r; r = r->next)
+    if(textpte(r->pte))
+      return r->pte;
+  return 0;
+}
+
+// Is the page at pg cached?  Caller holds its lock.
+int
+textpage(char *pg)
+{
+  return textmapping(PAGE(pg)) != 0;
+}
+
+// If the page at pg, chosen for eviction, is cached, unmap
+// it everywhere and drop it from the cache, and return 1.
+// Caller holds its lock and must tlbshootdown.
+int
+textevict(char *pg)
+{
+  struct page *p;
+  struct rmap *r;
+  pte_t *cached;
+
+  p = PAGE(pg);
+  if((cached = textmapping(p)) == 0)
+    return 0;
+  if(!textpte(p->owner)){
+    *p->owner = 0;
+    tlbflushpte(p->owner);
+  }
+  for(r = p->rmap; r; r = r->next){
+    if(!textpte(r->pte)){
+      *r->pte = 0;
+      tlbflushpte(r->pte);
+    }
+  }
+  disown(pg);
+  *cached = 0;
+  text.ndrop++;
+  return 1;
+}
+
+// Drop ip's pages; it is being written or truncated.
+// Caller holds ip's lock.  textadd also runs with it held,
+// so ninode can be looked at without text.lock: another
+// inode's pages only make us search for nothing.
+void
+textinval(struct inode *ip)
+{
+  char *mem;
+  uint h;
+  int i;
+
+  h = inodehash(ip->dev, ip->inum);
+  if(text.ninode[h] == 0)
+    return;
+  i = 0;
+  while(i < NTEXTPAGE){
+    mem = 0;
+    acquire(&text.lock);
+    for(; i < NTEXTPAGE && mem == 0; i++){
+      if(text.key[i].dev == ip->dev && text.key[i].inum == ip->inum){
+        mem = textdrop(i);
+        text.key[i].dev = text.key[i].inum = 0;
+        text.ninode[h]--;
+      }
+    }
+    release(&text.lock);
+    if(mem)
+      kfree(mem, 0, 0);
+  }
+}
+
+// Print cache usage.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+textdump(void)
+{
+  int i, n;
+
+  n = 0;
+  for(i = 0; i < NTEXTPAGE; i++)
+    if(text.pte[i] & PTE_P)
+      n++;
+  cprintf("text: %d pages cached; %d hits, %d misses, %d dropped\n",
+          n, text.nhit, text.nmiss, text.ndrop);
+}
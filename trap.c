@@ -53,12 +53,12 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      swaptick();
     }
     lapiceoi();
     break;
   case T_PGFLT:
-    if (!(tf->err & PTE_P)) {
-      segflthandler(tf->err & PTE_U);
+    if (segflthandler(tf->err)) {
       lapiceoi();
       break;
     }
@@ -76,6 +76,10 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    tlbpoll();
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
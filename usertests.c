@@ -4,6 +4,7 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "mman.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -1313,6 +1314,272 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// does a forked child get its own copy of memory
+// that it writes after the fork?
+void
+cowtest(void)
+{
+  char *p;
+  int i, pid;
+
+  printf(1, "cow test\n");
+  p = sbrk(8*4096);
+  if(p == (char*)0xffffffff){
+    printf(1, "cow test sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < 8*4096; i++)
+    p[i] = i % 251;
+  pid = fork();
+  if(pid < 0){
+    printf(1, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < 8*4096; i++){
+      if(p[i] != i % 251){
+        printf(1, "cow test child saw wrong data\n");
+        exit();
+      }
+      p[i] = 'c';
+    }
+    exit();
+  }
+  wait();
+  for(i = 0; i < 8*4096; i++){
+    if(p[i] != i % 251){
+      printf(1, "cow test parent saw child's write\n");
+      exit();
+    }
+  }
+  sbrk(-8*4096);
+  printf(1, "cow test OK\n");
+}
+
+// is memory from sbrk zero filled on first touch, both
+// from user space and when the kernel reads or writes it?
+void
+lazytest(void)
+{
+  char *p, buf[16];
+  int i, pid, fds[2];
+
+  printf(1, "lazy test\n");
+  p = sbrk(20*1024*1024);
+  if(p == (char*)0xffffffff){
+    printf(1, "lazy test sbrk failed\n");
+    exit();
+  }
+  if(pipe(fds) != 0){
+    printf(1, "lazy test pipe failed\n");
+    exit();
+  }
+  // kernel reads an untouched page
+  if(write(fds[1], p + 5*1024*1024, sizeof(buf)) != sizeof(buf)){
+    printf(1, "lazy test write failed\n");
+    exit();
+  }
+  // kernel writes another one
+  if(read(fds[0], p + 15*1024*1024, sizeof(buf)) != sizeof(buf)){
+    printf(1, "lazy test read failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(p[15*1024*1024 + i] != 0){
+      printf(1, "lazy test page not zero\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 20*1024*1024; i += 1024*1024)
+    p[i] = 1;
+  pid = fork();
+  if(pid < 0){
+    printf(1, "lazy test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[1024*1024] != 1 || p[1024*1024 + 4096] != 0){
+      printf(1, "lazy test child saw wrong data\n");
+      exit();
+    }
+    p[1024*1024 + 4096] = 2;
+    exit();
+  }
+  wait();
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-20*1024*1024);
+  printf(1, "lazy test OK\n");
+}
+
+void
+madvisetest(void)
+{
+  char *p, *a;
+  int i;
+
+  printf(1, "madvise test\n");
+  p = sbrk(9*4096);
+  a = (char*)(((uint)p + 4095) & ~4095);
+  for(i = 0; i < 8; i++)
+    a[i*4096] = i + 1;
+  if(madvise(a + 1, 4096, MADV_COLD) != -1 ||
+     madvise(a, 4096, 99) != -1 ||
+     madvise((char*)KERNBASE - 4096, 4096, MADV_COLD) != -1){
+    printf(1, "madvise test accepted bad arguments\n");
+    exit();
+  }
+  if(madvise(a, 2*4096, MADV_DONTNEED) != 0 || a[0] != 0 || a[4096] != 0){
+    printf(1, "madvise test dontneed failed\n");
+    exit();
+  }
+  if(madvise(a + 2*4096, 4*4096, MADV_SEQUENTIAL) != 0 ||
+     madvise(a + 2*4096, 2*4096, MADV_COLD) != 0 ||
+     madvise(a, 8*4096, MADV_WILLNEED) != 0 ||
+     madvise(a + 3*4096, 4096, MADV_NORMAL) != 0){
+    printf(1, "madvise test failed\n");
+    exit();
+  }
+  for(i = 2; i < 8; i++){
+    if(a[i*4096] != i + 1){
+      printf(1, "madvise test lost data\n");
+      exit();
+    }
+  }
+  sbrk(-9*4096);
+  printf(1, "madvise test OK\n");
+}
+
+void
+mmaptest(void)
+{
+  char *p, *q, buf[512];
+  int fd, fds[2], i, j, pid;
+
+  printf(1, "mmap test\n");
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < 2*4096; i += sizeof(buf)){
+    for(j = 0; j < sizeof(buf); j++)
+      buf[j] = 'a' + (i + j) % 26;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "mmap test write failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, 3*4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 4096);
+  if(p == (char*)-1 || q == (char*)-1 || p < sbrk(0) || q < sbrk(0)){
+    printf(1, "mmap test mmap failed\n");
+    exit();
+  }
+  if(p[0] != 'a' || p[4096+1] != 'a' + (4096+1) % 26 || p[2*4096] != 0){
+    printf(1, "mmap test read wrong data\n");
+    exit();
+  }
+  // Nor may the kernel store into read-only mappings.
+  if(read(fd, p, 1) != -1 || read(fd, p + 2*4096, 1) != -1){
+    printf(1, "mmap test read into PROT_READ\n");
+    exit();
+  }
+  q[0] = 'X';
+  // The kernel can use mapped memory too.
+  if(pipe(fds) != 0 || write(fds[1], q, 1) != 1 ||
+     read(fds[0], buf, 1) != 1 || buf[0] != 'X'){
+    printf(1, "mmap test pipe failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(munmap(q + 1, 4096) != -1 || munmap(q, 4096) != 0){
+    printf(1, "mmap test munmap failed\n");
+    exit();
+  }
+  munmap(p, 3*4096);
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 1) != 1 || buf[0] != 'a' ||
+     mmap(0, 4096, PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf(1, "mmap test bad file\n");
+    exit();
+  }
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 4096);
+  if(p == (char*)-1 || p[0] != 'X'){
+    printf(1, "mmap test shared write lost\n");
+    exit();
+  }
+  close(fd);
+
+  // Every mapping of a page shares one copy, which write()
+  // goes to as well, so writing it back loses nothing.
+  fd = open("mmapfile", O_RDWR);
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(q == (char*)-1){
+    printf(1, "mmap test mmap failed\n");
+    exit();
+  }
+  q[0] = 'P';
+  pid = fork();
+  if(pid == 0){
+    p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == (char*)-1 || p[0] != 'P' || q[0] != 'P'){
+      printf(1, "mmap test not shared\n");
+      exit();
+    }
+    p[1] = 'C';
+    q[3] = 'F';  // the child inherits q
+    exit();
+  }
+  wait();
+  if(read(fd, buf, 2) != 2 || write(fd, "W", 1) != 1 ||
+     q[1] != 'C' || q[2] != 'W' || q[3] != 'F'){
+    printf(1, "mmap test not shared\n");
+    exit();
+  }
+  munmap(q, 4096);
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 3) != 3 || buf[0] != 'P' || buf[1] != 'C' || buf[2] != 'W'){
+    printf(1, "mmap test shared write lost\n");
+    exit();
+  }
+  close(fd);
+
+  // A file may be removed while it is mapped; it is freed
+  // when the last mapping goes, by munmap or by exit.
+  for(i = 0; i < 2; i++){
+    pid = fork();
+    if(pid == 0){
+      fd = open("mmapfile", O_RDWR);
+      q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(q == (char*)-1 || unlink("mmapfile") != 0){
+        printf(1, "mmap test unlink failed\n");
+        exit();
+      }
+      q[0] = 'U';
+      if(i == 0 && munmap(q, 4096) != 0){
+        printf(1, "mmap test munmap failed\n");
+        exit();
+      }
+      exit();
+    }
+    wait();
+    fd = open("mmapfile", O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "mmap test write failed\n");
+      exit();
+    }
+    close(fd);
+  }
+  unlink("mmapfile");
+  printf(1, "mmap test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1626,6 +1893,9 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazytest();
+  madvisetest();
+  mmaptest();
   validatetest();
 
   opentest();
@@ -1652,6 +1922,7 @@ main(int argc, char *argv[])
   dirfile();
   iref();
   forktest();
+  cowtest();
   bigdir(); // slow
 
   exectest();
@@ -5,11 +5,20 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "elf.h"
+#include "traps.h"
+#include "page.h"
+#include "mman.h"
+#include "fs.h"
+#include "file.h"
 
 extern char data[];  // defined by kernel.ld
-extern struct spinlock ownerlock; //kalloc.c
+static void tlbinit(void);
+static char *lockpte(pte_t*);
 pde_t *kpgdir;  // for use in scheduler()
+// Mapped copy-on-write wherever untouched memory is read.
+char zeropg[PGSIZE] __attribute__((__aligned__(PGSIZE)));
 struct segdesc gdt[NSEGS];
 
 // Set up CPU's kernel segment descriptors.
@@ -61,6 +70,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
     // be further restricted by the permissions in the page table 
     // entries, if necessary.
     *pde = v2p(pgtab) | PTE_P | PTE_W | PTE_U;
+    PAGE(pgtab)->pde = pde;
   }
   return &pgtab[PTX(va)];
 }
@@ -112,44 +122,58 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 // (directly addressable from end..P2V(PHYSTOP)).
 
 // This table defines the kernel's mappings, which are present in
-// every process's page table.
+// every process's page table.  They are global (PTE_G), so
+// switching page tables doesn't flush them from the TLB.  They
+// never change after boot; if they did, a %cr3 load wouldn't
+// flush them either, and the change would need an invlpg on
+// every cpu.
 static struct kmap {
   void *virt;
   uint phys_start;
   uint phys_end;
   int perm;
 } kmap[] = {
- { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
- { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
- { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
+ { (void*)KERNBASE, 0,             EXTMEM,    PTE_W|PTE_G}, // I/O space
+ { (void*)KERNLINK, V2P(KERNLINK), V2P(data), PTE_G},       // kern text+rodata
+ { (void*)data,     V2P(data),     PHYSTOP,   PTE_W|PTE_G}, // kern data+memory
+ { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W|PTE_G}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Set up kernel part of a page table.  The kernel's page
+// tables are built once, in kpgdir, and every page table
+// shares them by copying kpgdir's PDEs above KERNBASE.
+// freevm leaves them alone.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
   if((pgdir = (pde_t*)kalloc(0)) == 0)
     return 0;
   memset(pgdir, 0, PGSIZE);
-  if (p2v(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start, 
-                (uint)k->phys_start, k->perm) < 0)
-      return 0;
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, and the kernel page tables
+// that setupkvm shares with every process.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kalloc(0)) == 0)
+    panic("kvmalloc");
+  memset(kpgdir, 0, PGSIZE);
+  tlbinit();
+  if (p2v(PHYSTOP) > (void*)DEVSPACE)
+    panic("PHYSTOP too high");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mappages(kpgdir, k->virt, k->phys_end - k->phys_start, 
+                (uint)k->phys_start, k->perm) < 0)
+      panic("kvmalloc");
   switchkvm();
 }
 
@@ -173,10 +197,185 @@ switchuvm(struct proc *p)
   ltr(SEG_TSS << 3);
   if(p->pgdir == 0)
     panic("switchuvm: no pgdir");
+  cpu->pgdir = p->pgdir;  // before the switch, for tlbshootdown
   lcr3(v2p(p->pgdir));  // switch to new address space
   popcli();
 }
 
+// TLB invalidation.  After a present PTE is changed or
+// cleared, the cpu may go on using the old one from its TLB
+// until it is flushed.  PTEs that weren't present need no
+// flush, since the TLB doesn't hold those.  These flush only
+// this cpu's TLB, and only if pgdir is loaded on it; a
+// process runs on one cpu at a time, so that is enough for
+// its own page table.  PTEs of other processes, which
+// eviction changes, also need tlbflushpte and tlbshootdown.
+
+// Ranges longer than this reload %cr3 instead.
+#define TLBFLUSHMAX 32
+
+// Flush the TLB entry for va in pgdir.
+void
+tlbflush(pde_t *pgdir, uint va)
+{
+  if(rcr3() == v2p(pgdir))
+    invlpg(va);
+}
+
+// Flush the TLB entries for [va, va+len) in pgdir.
+void
+tlbflushrange(pde_t *pgdir, uint va, uint len)
+{
+  uint a;
+
+  if(len == 0 || rcr3() != v2p(pgdir))
+    return;
+  if(len > TLBFLUSHMAX*PGSIZE){
+    tlbflushall(pgdir);
+    return;
+  }
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    invlpg(a);
+}
+
+// Flush all of pgdir's user entries from the TLB.  The
+// kernel's mappings are global and stay.
+void
+tlbflushall(pde_t *pgdir)
+{
+  if(rcr3() == v2p(pgdir))
+    lcr3(v2p(pgdir));
+}
+
+// Cross-cpu TLB shootdown.  tlbflushpte queues the page in
+// tlbq if another cpu has its page table loaded, and
+// tlbshootdown sends a single IPI to each cpu that still has
+// one of the queued page tables loaded, then waits until all
+// have flushed.  Cpus that switched page tables meanwhile are
+// skipped, since loading %cr3 flushed them.  Pages queued
+// without a tlbshootdown (e.g. for clearing PTE_A) go with
+// the next one, or with another cpu's.  tlbq.lock protects
+// tlbq, and is held for the whole shootdown; a cpu spinning
+// for a lock with interrupts off flushes from tlbpoll.
+#define TLBBATCH 32
+
+static struct {
+  struct spinlock lock;
+  pde_t *pgdir[TLBBATCH];
+  uint va[TLBBATCH];
+  int n;                   // Above TLBBATCH: flush everything
+} tlbq;
+
+static void
+tlbinit(void)
+{
+  initlock(&tlbq.lock, "tlbq");
+}
+
+// Is pgdir loaded on a cpu other than this one?
+static int
+tlbremote(pde_t *pgdir)
+{
+  struct cpu *c;
+
+  mfence();  // our PTE change is seen before we look
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c != cpu && c->pgdir == pgdir)
+      return 1;
+  return 0;
+}
+
+// Is a page of pgdir queued?  Caller holds tlbq.lock.
+static int
+tlbqueued(pde_t *pgdir)
+{
+  int i;
+
+  if(pgdir == 0)
+    return 0;
+  if(tlbq.n > TLBBATCH)
+    return 1;
+  for(i = 0; i < tlbq.n; i++)
+    if(tlbq.pgdir[i] == pgdir)
+      return 1;
+  return 0;
+}
+
+// Flush the TLB entry for pte, a PTE in a user page
+// table, found through the PDE that walkpgdir recorded.
+// PTEs outside any page table (text.c's) need nothing.
+// Caller holds the lock of the page pte maps, or mapped.
+void
+tlbflushpte(pte_t *pte)
+{
+  pde_t *pde, *pgdir;
+  uint va;
+
+  if((pde = PAGE((char*)pte)->pde) == 0)
+    return;
+  pgdir = (pde_t*)PGROUNDDOWN((uint)pde);
+  va = PGADDR(((uint)pde % PGSIZE) / sizeof(pde_t),
+              ((uint)pte % PGSIZE) / sizeof(pte_t), 0);
+  tlbflush(pgdir, va);
+  if(ncpu == 1 || !tlbremote(pgdir))
+    return;
+  acquire(&tlbq.lock);
+  if(tlbq.n < TLBBATCH){
+    tlbq.pgdir[tlbq.n] = pgdir;
+    tlbq.va[tlbq.n] = va;
+  }
+  if(tlbq.n <= TLBBATCH)
+    tlbq.n++;
+  release(&tlbq.lock);
+}
+
+// Make the other cpus flush the pages queued by tlbflushpte,
+// and wait until they have.  Caller holds the pages' locks,
+// so nobody can map them again meanwhile.
+void
+tlbshootdown(void)
+{
+  struct cpu *c;
+
+  acquire(&tlbq.lock);
+  if(tlbq.n == 0){
+    release(&tlbq.lock);
+    return;
+  }
+  mfence();
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == cpu || !tlbqueued(c->pgdir))
+      continue;
+    c->tlbwant = 1;
+    lapicipi(c->id, T_TLBFLUSH);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbwant)
+      ;
+  tlbq.n = 0;
+  release(&tlbq.lock);
+}
+
+// Do the flush tlbshootdown is waiting for, if any.
+// Called from the T_TLBFLUSH interrupt and from loops
+// that spin with interrupts off.
+void
+tlbpoll(void)
+{
+  int i;
+
+  if(!cpu->tlbwant)
+    return;
+  mfence();
+  if(tlbq.n > TLBBATCH)
+    lcr3(rcr3());
+  else
+    for(i = 0; i < tlbq.n; i++)
+      if(tlbq.pgdir[i] == cpu->pgdir)
+        invlpg(tlbq.va[i]);
+  cpu->tlbwant = 0;
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -190,38 +389,229 @@ inituvm(pde_t *pgdir, char *init, uint sz)
   memset(mem, 0, PGSIZE);
   mappages(pgdir, 0, PGSIZE, v2p(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
-	acquire(&ownerlock);
+  lockpage(mem);
   own(mem, walkpgdir(pgdir,0,0));
-	release(&ownerlock);
+  unlockpage(mem);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+// Map the page at va of p's MAP_SHARED area v to the frame
+// that every mapping of that page of the file shares
+// (share.c), reading it in if nobody has yet.  Past the end
+// of the file p gets a zero page of its own, which isn't
+// written back.  Returns 0 on success, -1 on error.
+static int
+loadshared(struct proc *p, struct vma *v, uint va, int write)
 {
-  uint i, pa, n;
+  struct rmap *r;
   pte_t *pte;
+  char *mem, *cached;
+  uint off, n;
 
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-		acquire(&ownerlock);
-    unswappage(pte); // Make sure page isn't actually swapped out.
-		release(&ownerlock);
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
+  off = v->off + PGROUNDDOWN(va) - v->start;
+  if((pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0)
+    return -1;
+  if((mem = kalloc(0)) == 0)
+    return -1;
+  if((r = rmapalloc()) == 0){
+    kfree(mem, 0, 0);
+    return -1;
+  }
+  ilock(v->ip);
+  if(off >= v->ip->size){
+    iunlock(v->ip);
+    rmapfree(r);
+    kfree(mem, 0, 0);
+    return zeropage(p->pgdir, va, write, v->prot);
+  }
+  if((cached = sharelookup(v->ip, off)) == 0){
+    if(v->ip->size - off < PGSIZE)
+      n = v->ip->size - off;
     else
       n = PGSIZE;
-    if(readi(ip, p2v(pa), offset+i, n) != n)
+    memset(mem, 0, PGSIZE);
+    if(readi(v->ip, mem, off, n) != n || shareadd(v->ip, off, mem) < 0){
+      iunlock(v->ip);
+      rmapfree(r);
+      kfree(mem, 0, 0);
+      return -1;
+    }
+    cached = mem;
+    mem = 0;
+  }
+  *pte = v2p(cached) | v->prot | PTE_U | PTE_P;
+  rmapadd(cached, pte, r);
+  unlockpage(cached);
+  iunlock(v->ip);
+  if(mem)
+    kfree(mem, 0, 0);
+  return 0;
+}
+
+// Fill in the page at va on its first touch, as the area
+// of p holding it says: from its file, or with zeros.  File
+// pages are shared through the text cache (text.c), mapped
+// copy-on-write if the area is writable, or for MAP_SHARED
+// areas through the shared page cache.  The page isn't
+// evictable until it is filled and owned, since readi may
+// sleep.  write says whether the page is about to be written.
+// Returns 0 on success, -1 on error, if no area holds va, or
+// on a write to a read-only area.
+int
+loadpage(struct proc *p, uint va, int write)
+{
+  struct vma *v;
+  struct rmap *r;
+  pte_t *pte;
+  char *mem, *cached;
+  uint off, n, flags;
+
+  if((v = vmafind(p->vma, p->nvma, va)) == 0)
+    return -1;
+  if(write && !(v->prot & PTE_W))
+    return -1;
+  if(v->type == VMA_SHARED)
+    return loadshared(p, v, va, write);
+  off = PGROUNDDOWN(va) - v->start;
+  if(v->type != VMA_FILE || off >= v->filesz)
+    return zeropage(p->pgdir, va, write, v->prot);
+
+  if((pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0)
+    return -1;
+  if((mem = kalloc(0)) == 0)
+    return -1;
+  if((r = rmapalloc()) == 0){
+    kfree(mem, 0, 0);
+    return -1;
+  }
+  if(v->filesz - off < PGSIZE)
+    n = v->filesz - off;
+  else
+    n = PGSIZE;
+  flags = PTE_U | PTE_P;
+  if(v->prot & PTE_W)
+    flags |= PTE_COW;
+  ilock(v->ip);
+  if((cached = textlookup(v->ip, v->off + off, n)) != 0){
+    *pte = v2p(cached) | flags;
+    rmapadd(cached, pte, r);
+    unlockpage(cached);
+    iunlock(v->ip);
+    kfree(mem, 0, 0);
+    return 0;
+  }
+  memset(mem, 0, PGSIZE);
+  if(readi(v->ip, mem, v->off + off, n) != n){
+    iunlock(v->ip);
+    rmapfree(r);
+    kfree(mem, 0, 0);
+    return -1;
+  }
+  textadd(v->ip, v->off + off, n, mem, &cached);
+  *pte = v2p(mem) | flags;
+  rmapadd(mem, pte, r);
+  unlockpage(mem);
+  iunlock(v->ip);
+  if(cached)
+    kfree(cached, 0, 0);
+  return 0;
+}
+
+// Bring the pages of [a, last] that p hasn't got in memory
+// in, with copies of their own if write is set.  If i isn't
+// -1, pin them and record them in p's pin range i.
+// Returns 0 on success, -1 on error.
+static int
+pagein(struct proc *p, uint a, uint last, int write, int i)
+{
+  pte_t *pte;
+  char *mem;
+
+  while(a <= last){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P) && (!write || !(*pte & PTE_COW))){
+      if(i >= 0 && PTE_ADDR(*pte) != v2p(zeropg)){
+        if((mem = lockpte(pte)) == 0)
+          continue;  // evicted meanwhile
+        PAGE(mem)->pins++;
+        unlockpage(mem);
+      }
+      a += PGSIZE;
+      if(i >= 0)
+        p->pinend[i] = a;
+      continue;
+    }
+    if(pte && (*pte & PTE_P)){
+      if(cowpage(pte) < 0)
+        return -1;
+    } else if(pte && PTE_ONDISK(*pte)){
+      if(!unswappage(pte, SWAPREADAHEAD))
+        return -1;
+    } else if(loadpage(p, a, write) < 0)
       return -1;
   }
   return 0;
 }
 
+// Bring the pages of [va, va+len) that p hasn't got in
+// memory in, and pin them there until the current system
+// call returns (unpopulate), so the kernel can use them
+// while holding a spinlock or the executable's inode lock,
+// where it can't take a page fault.  If write is set the
+// kernel will write them, so pages shared copy-on-write, or
+// only read so far, get their own copy; the caller has
+// checked that the areas are writable.  The zero page needs
+// no pin.  Returns 0 on success, -1 on error.
+int
+populate(struct proc *p, uint va, uint len, int write)
+{
+  int i;
+
+  if(len == 0)
+    return 0;
+  if(p->npin == NPIN)
+    panic("populate");
+  i = p->npin++;
+  p->pinstart[i] = p->pinend[i] = PGROUNDDOWN(va);
+  return pagein(p, PGROUNDDOWN(va), PGROUNDDOWN(va + len - 1), write, i);
+}
+
+// Bring the pages of [va, va+len) in for the kernel to read
+// without pinning them, for the words and strings that
+// fetchint and fetchstr read right away, so that a failure
+// is an error for the system call rather than in the fault
+// handler.  Returns 0 on success, -1 on error.
+int
+prefault(struct proc *p, uint va, uint len)
+{
+  if(len == 0)
+    return 0;
+  return pagein(p, PGROUNDDOWN(va), PGROUNDDOWN(va + len - 1), 0, -1);
+}
+
+// Unpin the pages populate pinned for p's system call,
+// which has returned.  Nothing has changed their PTEs, since
+// they can't be evicted, and the kernel only writes through
+// pages populated for writing, which have their own copy.
+void
+unpopulate(struct proc *p)
+{
+  uint a;
+  pte_t *pte;
+  char *mem;
+  int i;
+
+  for(i = 0; i < p->npin; i++){
+    for(a = p->pinstart[i]; a < p->pinend[i]; a += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte && (mem = lockpte(pte)) != 0){
+        PAGE(mem)->pins--;
+        unlockpage(mem);
+      }
+    }
+  }
+  p->npin = 0;
+}
+
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -245,13 +635,46 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
     }
     memset(mem, 0, PGSIZE);
     mappages(pgdir, (char*)a, PGSIZE, v2p(mem), PTE_W|PTE_U);
-		acquire(&ownerlock);
+    lockpage(mem);
     own(mem,walkpgdir(pgdir,(char*)a,0));
-		release(&ownerlock);
+    unlockpage(mem);
   }
   return newsz;
 }
 
+// Map a zeroed page at va, which lies in heap that growproc
+// reserved, or past the end of a mapped file, and nobody has
+// touched yet.  Called on the first page fault there.  A read
+// maps the shared zero page, copy-on-write if prot has PTE_W,
+// so memory that is only read costs nothing; a write gets a
+// page of its own, and fails in a read-only area.
+// Returns 0 on success, -1 if out of memory or not writable.
+int
+zeropage(pde_t *pgdir, uint va, int write, int prot)
+{
+  char *mem;
+  pte_t *pte;
+
+  // Get the page table first, so a failure can't leave
+  // an unowned page sitting in the eviction queue.
+  if((pte = walkpgdir(pgdir, (char*)va, 1)) == 0)
+    return -1;
+  if(write && !(prot & PTE_W))
+    return -1;
+  if(!write){
+    *pte = v2p(zeropg) | (prot & PTE_W ? PTE_COW : 0) | PTE_U | PTE_P;
+    return 0;
+  }
+  if((mem = kalloc(1)) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  lockpage(mem);
+  *pte = v2p(mem) | PTE_W | PTE_U | PTE_P;
+  own(mem, pte);
+  unlockpage(mem);
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -269,34 +692,39 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
-      a += (NPTENTRIES - 1) * PGSIZE;
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE; // skip to next page table
     else if (PTE_ONDISK(*pte)) {
       kfree(0,1,pte);//Will free disk resources
-										 //Will acquire ownerlock
+      *pte = 0;
     }
     else if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree1");
       char *v = p2v(pa);
-      kfree(v,1,pte);
+      if(v != zeropg)
+        kfree(v,1,pte);
       *pte = 0;
     }
   }
+  if(PGROUNDUP(newsz) < oldsz)
+    tlbflushrange(pgdir, PGROUNDUP(newsz), oldsz - PGROUNDUP(newsz));
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part, which lie in the nvma areas vma.
 void
-freevm(pde_t *pgdir)
+freevm(pde_t *pgdir, struct vma *vma, int nvma)
 {
+  struct vma *v;
   uint i;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
-  deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(v = vma; v < &vma[nvma]; v++)
+    deallocuvm(pgdir, v->end, v->start);
+  for(i = 0; i < PDX(KERNBASE); i++){ // kernel's are shared
     if(pgdir[i] & PTE_P){
       char * v = p2v(PTE_ADDR(pgdir[i]));
       kfree(v,0,0);
@@ -318,44 +746,334 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Lock the page pte maps and return it, or return 0 if pte
+// doesn't map a page, or maps the zero page, which has no
+// lock.  Eviction may change pte until the page is locked,
+// so it is looked at again then.
+static char*
+lockpte(pte_t *pte)
+{
+  pte_t e;
+  char *mem;
+
+  for(;;){
+    e = *pte;
+    if(!(e & PTE_P) || PTE_ADDR(e) == v2p(zeropg))
+      return 0;
+    mem = p2v(PTE_ADDR(e));
+    lockpage(mem);
+    if((*pte & PTE_P) && PTE_ADDR(*pte) == PTE_ADDR(e))
+      return mem;
+    unlockpage(mem);
+  }
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child, for the memory in the nvma areas vma.
+// Pages are shared copy-on-write rather than copied, and
+// swapped pages share their swap slot until either process
+// faults them back in.  MAP_SHARED frames (share.c) are
+// just mapped by the child too, writable if they were.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, struct vma *vma, int nvma)
 {
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
+  pte_t *pte, *npte;
+  struct rmap *r;
+  struct vma *v;
   char *mem;
+  uint i;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P)) {
-      if (!PTE_ONDISK(*pte))
-        panic("copyuvm: page not present");
+  for(v = vma; v < &vma[nvma]; v++){
+    for(i = v->start; i < v->end; i += PGSIZE){
+      if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+        i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE; // untouched heap
+        continue;
+      }
+      if(!(*pte & PTE_P) && !PTE_ONDISK(*pte))
+        continue; // untouched heap; zero filled on first touch
+      // Allocate the child's page table and rmap entry before
+      // locking the page, since kalloc may have to evict.
+      if((npte = walkpgdir(d, (void*)i, 1)) == 0)
+        goto bad;
+      if((r = rmapalloc()) == 0)
+        goto bad;
+      if((mem = lockpte(pte)) != 0){
+        if((*pte & PTE_W) && !(PAGE(mem)->flags & PG_SHARED))
+          *pte = (*pte & ~PTE_W) | PTE_COW;
+        rmapadd(mem, npte, r);
+        r = 0;
+      } else if(PTE_ONDISK(*pte)){
+        freeswapdup(((uint)*pte) >> 12);
+      }
+      // The zero page isn't counted, and a page evicted from
+      // the text cache meanwhile is just not mapped.
+      *npte = *pte;
+      if(mem)
+        unlockpage(mem);
+      if(r)
+        rmapfree(r);
     }
-    if((mem = kalloc(1)) == 0)
-      goto bad;
-    unswappage(pte); //Ensure page is in memory
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    memmove(mem, (char*)p2v(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
-      goto bad;
-		acquire(&ownerlock);
-    own(mem,walkpgdir(d,(void*)i,0));
-		release(&ownerlock);
   }
+  tlbflushall(pgdir);  // parent's pages are now read-only
   return d;
 
 bad:
-  freevm(d);
+  tlbflushall(pgdir);
+  freevm(d, vma, nvma);
   return 0;
 }
 
+// Give pte its own writable copy of a page shared
+// copy-on-write by fork, or of the zero page.  If every
+// other process has already let go of the page it is
+// simply taken back; the zero page's refs stays 0, so it
+// never is.
+// Returns 0 on success, -1 if out of memory.
+int
+cowpage(pte_t *pte)
+{
+  char *mem, *old;
+  uint flags;
+
+  if((old = lockpte(pte)) != 0){
+    if(krefs(old) == 1){
+      *pte = (*pte | PTE_W) & ~PTE_COW;
+      tlbflushpte(pte);
+      unlockpage(old);
+      return 0;
+    }
+    unlockpage(old);
+  }
+  if((mem = kalloc(0)) == 0)
+    return -1;
+  old = 0;
+  if(!(*pte & PTE_P) ||
+     (PTE_ADDR(*pte) != v2p(zeropg) && (old = lockpte(pte)) == 0)){
+    // Evicted while we allocated; the next fault reads it in.
+    kfree(mem, 0, 0);
+    return 0;
+  }
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(old && krefs(old) == 1){
+    *pte = v2p(old) | flags;
+    tlbflushpte(pte);
+    unlockpage(old);
+    kfree(mem, 0, 0);
+    return 0;
+  }
+  // Only this process changes a PTE that maps the zero page,
+  // so it needs no lock, and nobody else knows of mem yet.
+  memmove(mem, old ? old : zeropg, PGSIZE);
+  if(old){
+    rmapdel(old, pte); // Drops our reference to the shared page
+  }
+  *pte = v2p(mem) | flags;
+  tlbflushpte(pte);
+  if(old)
+    unlockpage(old);
+  lockpage(mem);
+  own(mem, pte);
+  scnodeenqueue(mem);
+  unlockpage(mem);
+  return 0;
+}
+
+// Write the shared frames in [start, end) of the current
+// process's shared file area v that any process has written
+// since they were last written back to the file, through the
+// log, a few blocks per transaction as in filewrite.  Our
+// mappings keep the frames from being evicted meanwhile.
+// Pages past the end of the file are not written; it
+// doesn't grow.
+static void
+mmapflusharea(struct vma *v, uint start, uint end)
+{
+  int max = ((LOGSIZE-1-1-2) / 2) * 512;
+  pte_t *pte;
+  char *mem;
+  uint a, i, n, off;
+  int dirty;
+
+  if(start < v->start)
+    start = v->start;
+  if(end > v->end)
+    end = v->end;
+  for(a = start; a < end; a += PGSIZE){
+    if((pte = walkpgdir(proc->pgdir, (char*)a, 0)) == 0 ||
+       (mem = lockpte(pte)) == 0)
+      continue;
+    // Pages past the end of the file are our own.
+    dirty = (PAGE(mem)->flags & PG_SHARED) && shareclean(mem);
+    tlbshootdown();
+    unlockpage(mem);
+    if(!dirty)
+      continue;
+    off = v->off + (a - v->start);
+    for(i = 0; i < PGSIZE; i += n){
+      begin_trans();
+      ilock(v->ip);
+      n = 0;
+      if(off + i < v->ip->size){
+        n = v->ip->size - (off + i);
+        if(n > max)
+          n = max;
+        if(n > PGSIZE - i)
+          n = PGSIZE - i;
+        writei(v->ip, mem + i, off + i, n);
+      }
+      iunlock(v->ip);
+      commit_trans();
+      if(n == 0)
+        break;
+    }
+  }
+}
+
+// Write back every shared file area of the current process
+// (exit, exec).
+void
+mmapflush(void)
+{
+  struct vma *v;
+
+  for(v = proc->vma; v < &proc->vma[proc->nvma]; v++)
+    if(v->type == VMA_SHARED)
+      mmapflusharea(v, v->start, v->end);
+}
+
+// Add v, an area mapping len bytes of v->ip, to the current
+// process, as high below KERNBASE as it fits.  Takes a
+// reference to v->ip.  Returns its address, or -1.
+int
+mmap(struct vma *v, uint len)
+{
+  len = PGROUNDUP(len);
+  if(len == 0 || (v->start = vmahole(proc->vma, proc->nvma, len,
+                                     PGROUNDUP(proc->sz), KERNBASE)) == 0)
+    return -1;
+  v->end = v->start + len;
+  if(v->filesz > len)
+    v->filesz = len;
+  if(vmaadd(proc->vma, &proc->nvma, v) < 0)
+    return -1;
+  idup(v->ip);
+  return v->start;
+}
+
+// Unmap the areas mmap made in [va, va+len), writing shared
+// ones back and splitting them if need be.  Returns 0, or -1
+// if va isn't page aligned or the range reaches below sz.
+int
+munmap(uint va, uint len)
+{
+  struct vma *v;
+  uint end;
+
+  end = PGROUNDUP(va + len);
+  if(va % PGSIZE || end < va || end > KERNBASE || va < PGROUNDUP(proc->sz))
+    return -1;
+  if(vmasplit(proc->vma, &proc->nvma, va) < 0 ||
+     vmasplit(proc->vma, &proc->nvma, end) < 0)
+    return -1;
+  for(v = proc->vma; v < &proc->vma[proc->nvma]; v++){
+    if(v->end <= va || v->start >= end)
+      continue;
+    if(v->type == VMA_SHARED)
+      mmapflusharea(v, v->start, v->end);
+    deallocuvm(proc->pgdir, v->end, v->start);
+  }
+  vmaremove(proc->vma, &proc->nvma, va, end);
+  return 0;
+}
+
+// Make the page at va in pgdir, if it is present and not
+// shared, the next one the replacement policy evicts.
+void
+coldpage(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((pte = walkpgdir(pgdir, (char*)va, 0)) == 0 ||
+     (mem = lockpte(pte)) == 0)
+    return;
+  if(PAGE(mem)->owner == pte && krefs(mem) == 1){
+    *pte &= ~PTE_A;
+    tlbflushpte(pte);
+    scnodecold(mem);
+  }
+  unlockpage(mem);
+}
+
+// Act on advice (see mman.h) about p's memory in [va, va+len).
+// MADV_DONTNEED frees the pages and their swap slots, so the
+// next touch reads them from the file or zero fills them;
+// MAP_SHARED pages are written back first.
+// MADV_WILLNEED reads swapped and untouched file pages in
+// now.  MADV_COLD puts the pages at the eviction head.
+// MADV_SEQUENTIAL and MADV_NORMAL are kept in the areas
+// for segflthandler, splitting them if need be.
+// Returns 0, or -1 if va isn't page aligned, some of the
+// range isn't in an area, or the advice is unknown.
+int
+madvise(struct proc *p, uint va, uint len, int advice)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint a, end;
+
+  end = PGROUNDUP(va + len);
+  if(va % PGSIZE || end < va || end > KERNBASE)
+    return -1;
+  for(a = va; a < end; a = v->end)
+    if((v = vmafind(p->vma, p->nvma, a)) == 0)
+      return -1;
+
+  switch(advice){
+  case MADV_NORMAL:
+  case MADV_SEQUENTIAL:
+    if(vmasplit(p->vma, &p->nvma, va) < 0 ||
+       vmasplit(p->vma, &p->nvma, end) < 0)
+      return -1;
+    for(v = vmafind(p->vma, p->nvma, va);
+        v < &p->vma[p->nvma] && v->start < end; v++)
+      v->advice = advice;
+    return 0;
+  case MADV_DONTNEED:
+    for(v = p->vma; v < &p->vma[p->nvma]; v++)
+      if(v->type == VMA_SHARED)
+        mmapflusharea(v, va, end);
+    for(a = va; a < end; a += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte && (*pte & PTE_P) && !(*pte & PTE_U))
+        continue;  // the stack guard page
+      deallocuvm(p->pgdir, a + PGSIZE, a);
+    }
+    return 0;
+  case MADV_WILLNEED:
+    for(a = va; a < end; a += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte && PTE_ONDISK(*pte)){
+        if(!unswappage(pte, SWAPCLUSTER))
+          break;  // out of memory; it's only a hint
+      } else if((!pte || !(*pte & (PTE_P|PTE_AVAIL))) &&
+                vmafind(p->vma, p->nvma, a)->ip){
+        if(loadpage(p, a, 0) < 0)
+          break;
+      }
+    }
+    return 0;
+  case MADV_COLD:
+    for(a = va; a < end; a += PGSIZE)
+      coldpage(p->pgdir, a);
+    return 0;
+  }
+  return -1;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -364,7 +1082,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
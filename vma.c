@@ -0,0 +1,257 @@
+// Virtual memory areas.
+//
+// A process's user memory is an array of areas sorted by
+// address (p->vma, see struct vma in proc.h), each a
+// page-aligned range with a type, protection and backing.
+// Pages are only filled in when first touched (loadpage in
+// vm.c), and fork and teardown go area by area, so only the
+// parts of the address space in use cost anything.
+//
+// These work on a bare array, so that exec can build the new
+// image's areas before committing to it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+
+// Return the area of vma[0..n) holding va, or 0.
+struct vma*
+vmafind(struct vma *vma, int n, uint va)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[n]; v++){
+    if(va < v->start)
+      break;
+    if(va < v->end)
+      return v;
+  }
+  return 0;
+}
+
+// Can b, which starts where a ends, be merged into a?
+static int
+vmajoins(struct vma *a, struct vma *b)
+{
+  return a->end == b->start && a->type == VMA_ANON &&
+         b->type == VMA_ANON && a->prot == b->prot &&
+         a->advice == b->advice;
+}
+
+// Add a copy of v to vma[0..*n), merging it with anonymous
+// neighbours.  Returns 0, or -1 if it overlaps an area or
+// there is no room.
+int
+vmaadd(struct vma *vma, int *n, struct vma *v)
+{
+  int i;
+
+  if(v->start >= v->end || v->start % PGSIZE || v->end % PGSIZE)
+    panic("vmaadd");
+  for(i = 0; i < *n && vma[i].start < v->start; i++)
+    ;
+  if((i > 0 && vma[i-1].end > v->start) ||
+     (i < *n && vma[i].start < v->end))
+    return -1;
+  if(i > 0 && vmajoins(&vma[i-1], v)){
+    vma[i-1].end = v->end;
+    if(i < *n && vmajoins(&vma[i-1], &vma[i])){
+      vma[i-1].end = vma[i].end;
+      memmove(&vma[i], &vma[i+1], (*n - i - 1) * sizeof(*vma));
+      (*n)--;
+    }
+    return 0;
+  }
+  if(i < *n && vmajoins(v, &vma[i])){
+    vma[i].start = v->start;
+    return 0;
+  }
+  if(*n >= NVMA)
+    return -1;
+  memmove(&vma[i+1], &vma[i], (*n - i) * sizeof(*vma));
+  vma[i] = *v;
+  (*n)++;
+  return 0;
+}
+
+// Cover the parts of [start, end) that no area of vma[0..*n)
+// holds with anonymous memory of protection prot.
+// Returns 0, or -1 if there is no room.
+int
+vmafill(struct vma *vma, int *n, uint start, uint end, int prot)
+{
+  struct vma v, *next;
+  uint a;
+  int i;
+
+  memset(&v, 0, sizeof(v));
+  v.type = VMA_ANON;
+  v.prot = prot;
+  for(a = start; a < end; a = v.end){
+    for(i = 0; i < *n && vma[i].end <= a; i++)
+      ;
+    next = i < *n ? &vma[i] : 0;
+    if(next && next->start <= a){
+      v.end = next->end;  // already covered
+      continue;
+    }
+    v.start = a;
+    v.end = (next && next->start < end) ? next->start : end;
+    if(vmaadd(vma, n, &v) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Split the area of vma[0..*n) holding va, if any, in two
+// at va, which must be page aligned.
+// Returns 0, or -1 if there is no room.
+int
+vmasplit(struct vma *vma, int *n, uint va)
+{
+  struct vma *v;
+  uint len;
+
+  if((v = vmafind(vma, *n, va)) == 0 || v->start == va)
+    return 0;
+  if(*n >= NVMA)
+    return -1;
+  memmove(v+1, v, (&vma[*n] - v) * sizeof(*v));
+  (*n)++;
+  len = va - v->start;
+  v[0].end = va;
+  v[1].start = va;
+  if(v[1].ip){
+    v[1].off += len;
+    v[1].filesz = v[1].filesz > len ? v[1].filesz - len : 0;
+    if(v[0].filesz > len)
+      v[0].filesz = len;
+  }
+  if(v[1].ip)
+    idup(v[1].ip);
+  return 0;
+}
+
+// Is no part of [start, end) in an area of vma[0..n)?
+int
+vmafree(struct vma *vma, int n, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[n]; v++)
+    if(v->start < end && v->end > start)
+      return 0;
+  return 1;
+}
+
+// Is all of [start, end) in areas of vma[0..n) whose
+// protection includes prot?
+int
+vmacovers(struct vma *vma, int n, uint start, uint end, int prot)
+{
+  struct vma *v;
+
+  if(end < start)
+    return 0;
+  while(start < end){
+    if((v = vmafind(vma, n, start)) == 0 || (v->prot & prot) != prot)
+      return 0;
+    start = v->end;
+  }
+  return 1;
+}
+
+// Return the start of the highest len bytes in [lo, hi)
+// that no area of vma[0..n) holds, or 0 if there are none.
+uint
+vmahole(struct vma *vma, int n, uint len, uint lo, uint hi)
+{
+  struct vma *v;
+  uint top;
+
+  top = hi;
+  for(v = &vma[n-1]; v >= vma && v->end > lo; v--){
+    if(v->start >= top)
+      continue;
+    if(v->end <= top && top - v->end >= len)
+      return top - len;
+    top = v->start;
+  }
+  if(top >= lo && top - lo >= len)
+    return top - len;
+  return 0;
+}
+
+// Take [start, end) out of the areas of vma[0..*n), which
+// must not split an area in two.  The caller frees the
+// memory first.  Files are let go of as in vmaput.
+void
+vmaremove(struct vma *vma, int *n, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[*n]; ){
+    if(v->end <= start || v->start >= end){
+      v++;
+      continue;
+    }
+    if(v->start < start && v->end > end)
+      panic("vmaremove: split");
+    if(v->start >= start && v->end <= end){
+      if(v->ip){
+        begin_trans();
+        iput(v->ip);
+        commit_trans();
+      }
+      memmove(v, v+1, (&vma[*n] - v - 1) * sizeof(*v));
+      (*n)--;
+      continue;
+    }
+    if(v->start < start){
+      v->end = start;
+      if(v->filesz > v->end - v->start)
+        v->filesz = v->end - v->start;
+    } else {
+      if(v->ip){
+        v->off += end - v->start;
+        v->filesz = v->filesz > end - v->start ? v->filesz - (end - v->start) : 0;
+      }
+      v->start = end;
+    }
+    v++;
+  }
+}
+
+// Take references to the files backing vma[0..n),
+// a copy of another process's areas (fork).
+void
+vmadup(struct vma *vma, int n)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[n]; v++)
+    if(v->ip)
+      idup(v->ip);
+}
+
+// Let go of the files backing vma[0..n).  The areas
+// stay, so that freevm can still find the memory.  The
+// last reference to a file that has been removed frees
+// it, so each is dropped in a transaction, as fileclose
+// does.
+void
+vmaput(struct vma *vma, int n)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[n]; v++){
+    if(v->ip){
+      begin_trans();
+      iput(v->ip);
+      commit_trans();
+      v->ip = 0;
+    }
+  }
+}
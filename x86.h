@@ -135,6 +135,20 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically replace *addr with newval if it holds old.
+// Returns what *addr held.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint newval)
+{
+  uint result;
+
+  asm volatile("lock; cmpxchgl %2, %0" :
+               "+m" (*addr), "=a" (result) :
+               "r" (newval), "1" (old) :
+               "cc", "memory");
+  return result;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -149,6 +163,22 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+// Full memory barrier: stores before it are seen by other
+// cpus before loads after it are done.
+static inline void
+mfence(void)
+{
+  asm volatile("lock; addl $0,0(%%esp)" : : : "memory");
+}
+
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().
@@ -0,0 +1,208 @@
+// Compressed swap pool in RAM, in front of the swap disk.
+//
+// A page being swapped out that lzcompress can shrink to half
+// a page or less is kept here instead of being written to disk.
+// Entries are keyed by the swap slot the page was given, so the
+// PTE looks the same either way and swap.c checks here before
+// reading a slot from disk. Once more than ZSWAPMAX pages are
+// held, swap.c writes the oldest one out to its slot.
+//
+// Entries come from slab caches of power-of-two sizes that
+// refill without evicting, since stores happen while evicting.
+// swap.c holds swapiolock around stores, loads and writebacks,
+// which orders them against disk I/O for the same slot, and
+// serializes lzcompress.  zlock protects the table and list,
+// which freeswapfree also changes when a slot is freed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "slab.h"
+
+#define NZCLASS 6  // Entry sizes 64 .. 2048 bytes
+
+struct zentry {
+  struct zentry *next;         // Oldest first
+  struct zentry *prev;
+  uint slot;
+  ushort len;                  // Compressed bytes in data
+  uchar class;                 // Index into zcache
+  uchar data[];
+};
+
+static char *zname[NZCLASS] = {
+  "zswap64", "zswap128", "zswap256", "zswap512", "zswap1024", "zswap2048",
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NZCLASS];
+  struct zentry **slot;        // Entry for each swap slot, or 0
+  uint nslots;                 // 0 if the pool is off
+  struct zentry lru;           // Sentinel of the list of entries
+  uint n;                      // Entries held
+  uint bytes;                  // Compressed bytes held
+  uint nstore, nreject, nload, nwriteback;
+} zpool;
+
+// Compression output; swapiolock protects it.
+static uchar zbuf[PGSIZE/2 - sizeof(struct zentry)];
+
+// Set up the pool for a swap disk of nslots slots.
+void
+zswapinit(uint nslots)
+{
+  int i, order;
+
+  initlock(&zpool.lock, "zswap");
+  zpool.lru.next = zpool.lru.prev = &zpool.lru;
+  if(ZSWAPMAX == 0 || nslots == 0)
+    return;
+  for(order = 0; (PGSIZE << order) < nslots * sizeof(struct zentry*); order++)
+    ;
+  if((zpool.slot = (struct zentry**)kalloc_order(order)) == 0)
+    panic("zswapinit");
+  memset(zpool.slot, 0, PGSIZE << order);
+  for(i = 0; i < NZCLASS; i++){
+    kmem_cache_init(&zpool.cache[i], zname[i], 64 << i);
+    zpool.cache[i].noevict = 1;
+  }
+  zpool.nslots = nslots;
+}
+
+// Unlink e, which is in the pool.  Caller holds zpool.lock.
+static void
+zunlink(struct zentry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  zpool.slot[e->slot] = 0;
+  zpool.n--;
+  zpool.bytes -= e->len;
+}
+
+// Try to keep pg, being swapped out to slot, compressed here.
+// Returns 1 if it was kept, 0 if it must be written to disk.
+// Caller holds swapiolock.
+int
+zswapstore(uint slot, char *pg)
+{
+  struct zentry *e;
+  int len, c;
+
+  if(zpool.nslots == 0)
+    return 0;
+  if((len = lzcompress((uchar*)pg, PGSIZE, zbuf, sizeof(zbuf))) < 0){
+    zpool.nreject++;
+    return 0;
+  }
+  for(c = 0; (64 << c) < sizeof(struct zentry) + len; c++)
+    ;
+  if((e = kmem_cache_alloc(&zpool.cache[c])) == 0){
+    zpool.nreject++;
+    return 0;
+  }
+  e->slot = slot;
+  e->len = len;
+  e->class = c;
+  memmove(e->data, zbuf, len);
+
+  acquire(&zpool.lock);
+  if(zpool.slot[slot])
+    panic("zswapstore: slot in use");
+  zpool.slot[slot] = e;
+  e->prev = zpool.lru.prev;
+  e->next = &zpool.lru;
+  e->prev->next = e;
+  zpool.lru.prev = e;
+  zpool.n++;
+  zpool.bytes += len;
+  zpool.nstore++;
+  release(&zpool.lock);
+  return 1;
+}
+
+// If slot's page is held here, expand it into pg and return 1.
+// The entry stays until the slot is freed, since processes
+// forked after the page was swapped out may still share it.
+// Caller holds swapiolock.
+int
+zswapload(uint slot, char *pg)
+{
+  struct zentry *e;
+
+  acquire(&zpool.lock);
+  if(zpool.nslots == 0 || (e = zpool.slot[slot]) == 0){
+    release(&zpool.lock);
+    return 0;
+  }
+  if(lzdecompress(e->data, e->len, (uchar*)pg, PGSIZE) != PGSIZE)
+    panic("zswapload: bad entry");
+  zpool.nload++;
+  release(&zpool.lock);
+  return 1;
+}
+
+// Is slot's page held here?
+int
+zswaphas(uint slot)
+{
+  return zpool.nslots && zpool.slot[slot] != 0;
+}
+
+// Forget slot's page, if held here; the slot is being freed.
+void
+zswapdrop(uint slot)
+{
+  struct zentry *e;
+
+  acquire(&zpool.lock);
+  if(zpool.nslots == 0 || (e = zpool.slot[slot]) == 0){
+    release(&zpool.lock);
+    return;
+  }
+  zunlink(e);
+  release(&zpool.lock);
+  kmem_cache_free(&zpool.cache[e->class], e);
+}
+
+// If more than ZSWAPMAX pages are held, take the oldest out,
+// expand it into pg and return its slot, for the caller to
+// write to disk.  Otherwise return -1.
+// Caller holds swapiolock.
+int
+zswapevict(char *pg)
+{
+  struct zentry *e;
+  int slot;
+
+  acquire(&zpool.lock);
+  if(zpool.n <= ZSWAPMAX){
+    release(&zpool.lock);
+    return -1;
+  }
+  e = zpool.lru.next;
+  if(lzdecompress(e->data, e->len, (uchar*)pg, PGSIZE) != PGSIZE)
+    panic("zswapevict: bad entry");
+  slot = e->slot;
+  zunlink(e);
+  zpool.nwriteback++;
+  release(&zpool.lock);
+  kmem_cache_free(&zpool.cache[e->class], e);
+  return slot;
+}
+
+// Print pool usage and traffic.
+// Runs when user types ^V on console.
+// No lock to avoid wedging a stuck machine further.
+void
+zswapdump(void)
+{
+  cprintf("zswap: %d pages in %d bytes; %d stored, %d rejected, "
+          "%d loaded, %d written back\n",
+          zpool.n, zpool.bytes, zpool.nstore, zpool.nreject,
+          zpool.nload, zpool.nwriteback);
+}